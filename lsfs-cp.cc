@@ -0,0 +1,219 @@
+//-*- mode: c++; tab-width: 4; indent-tabs-mode: t; c-file-style: "stroustrup";
+#include <lsfs.hh>
+#include <boost/program_options.hpp>
+#include <iostream>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+    struct job_t {
+	std::string path; //Path outside the filesystem
+	std::string name; //Name inside the filesystem
+	bool dir;
+    };
+
+    lsfs::FS fs;
+    std::vector<job_t> jobs;
+    size_t next=0;
+    size_t failed=0;
+    bool compress=false;
+    bool exporting=false;
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+    //Remove leading slashes and ./ so paths can be used as names
+    std::string clean(std::string p) {
+	while(true) {
+	    if(p.compare(0, 1, "/") == 0) p.erase(0, 1);
+	    else if(p.compare(0, 2, "./") == 0) p.erase(0, 2);
+	    else break;
+	}
+	while(!p.empty() && p[p.size()-1] == '/') p.erase(p.size()-1);
+	if(p == ".") p.clear();
+	return p;
+    }
+
+    std::string join(const std::string & a, const std::string & b) {
+	if(a.empty()) return b;
+	if(b.empty()) return a;
+	return a + "/" + b;
+    }
+
+    void fail(const std::string & what, const char * msg) {
+	pthread_mutex_lock(&mutex);
+	std::cerr << what << ": " << msg << std::endl;
+	++failed;
+	pthread_mutex_unlock(&mutex);
+    }
+
+    void walk(const std::string & path, const std::string & name) {
+	struct stat st;
+	if(lstat(path.c_str(), &st) == -1) {
+	    fail(path, strerror(errno));
+	    return;
+	}
+	if(S_ISREG(st.st_mode)) {
+	    job_t j = {path, name, false};
+	    jobs.push_back(j);
+	    return;
+	}
+	if(!S_ISDIR(st.st_mode)) return;
+	DIR * d = opendir(path.c_str());
+	if(d == NULL) {
+	    fail(path, strerror(errno));
+	    return;
+	}
+	while(struct dirent * e = readdir(d)) {
+	    if(strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) continue;
+	    walk(path + "/" + e->d_name, join(name, e->d_name));
+	}
+	closedir(d);
+    }
+
+    //Create all missing directories leading up to path
+    void mkdirs(const std::string & path) {
+	for(size_t i=path.find('/', 1); i != std::string::npos; i=path.find('/', i+1))
+	    mkdir(path.substr(0, i).c_str(), 0777);
+    }
+
+    void import(const job_t & j) {
+	int fd = open(j.path.c_str(), O_RDONLY);
+	if(fd == -1) throw lsfs::ErrnoException(errno, __LINE__, __FILE__, "Unable to open '%s'", j.path.c_str());
+	try {
+	    struct stat st;
+	    if(fstat(fd, &st) == -1) throw lsfs::ErrnoException(errno, __LINE__, __FILE__, "fstat");
+	    lsfs::Handle h;
+	    fs.open(j.name, false, &h, compress);
+	    //Allocate the whole file up front, so it ends up in as few chunks as possible
+	    h.truncate(compress?0:st.st_size);
+	    h.seek(0);
+	    h.copyFrom(fd, 0, st.st_size);
+	    //Store the tail of a compressed file now, closing would not report a failure
+	    h.flush();
+	} catch(...) {
+	    close(fd);
+	    throw;
+	}
+	close(fd);
+    }
+
+    void exportFile(const job_t & j) {
+	mkdirs(j.path);
+	if(j.dir) {
+	    mkdir(j.path.c_str(), 0777);
+	    return;
+	}
+	int fd = open(j.path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if(fd == -1) throw lsfs::ErrnoException(errno, __LINE__, __FILE__, "Unable to open '%s'", j.path.c_str());
+	try {
+	    lsfs::Handle h;
+	    fs.open(j.name, true, &h);
+	    uint64_t size = fs.size(j.name);
+	    if(size > 0) posix_fallocate(fd, 0, size);
+	    if(h.copyTo(fd, 0, size) != size) throw lsfs::ErrnoException(EIO, __LINE__, __FILE__, "Short copy");
+	} catch(...) {
+	    close(fd);
+	    throw;
+	}
+	close(fd);
+    }
+
+    void * worker(void *) {
+	while(true) {
+	    pthread_mutex_lock(&mutex);
+	    size_t i = next++;
+	    pthread_mutex_unlock(&mutex);
+	    if(i >= jobs.size()) break;
+	    const job_t & j = jobs[i];
+	    try {
+		if(exporting) exportFile(j);
+		else import(j);
+	    } catch(lsfs::InternalError & e) {
+		fail(exporting?j.name:j.path, e.what());
+	    } catch(lsfs::ErrnoException & e) {
+		fail(exporting?j.name:j.path, e.what());
+	    }
+	}
+	return NULL;
+    }
+}
+
+int main(int argc, char ** argv) {
+    namespace po = boost::program_options;
+    po::options_description desc("Usage: lsfs.cp [OPTIONS]... PATH...\n\n"
+				 "Copy files and directories into a lsfs file system, or out of it with --export");
+    std::vector<std::string> devs;
+    std::vector<std::string> paths;
+    std::string target;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t threads = cpus > 0 ? cpus : 1;
+    desc.add_options()
+	("help,h","This help message.")
+	("device,d",po::value<std::vector<std::string> >(&devs),"The device files of the filesystem")
+	("export,x","Copy PATHs out of the filesystem")
+	("target,t",po::value<std::string>(&target),"Directory to copy to, inside the filesystem unless exporting")
+	("jobs,j",po::value<size_t>(&threads),"Number of files to copy at the same time")
+	("compress,z","Store imported files compressed")
+	("path",po::value<std::vector<std::string> >(&paths),"Files or directories to copy");
+    po::positional_options_description pd;
+    pd.add("path", -1);
+
+    try {
+	po::variables_map vm;
+	po::parsed_options parsed = po::command_line_parser(argc, argv).options(desc).positional(pd).run();
+	po::store(parsed, vm);
+	po::notify(vm);
+	if (vm.count("help")) {
+	    std::cout << desc << std::endl;
+	    return 0;
+	}
+	if(devs.empty()) throw po::error("you must specify a device file");
+	if(paths.empty()) throw po::error("you must specify what to copy");
+	exporting = vm.count("export");
+	compress = vm.count("compress");
+	fs.mount(devs, exporting);
+	if(exporting) {
+	    for(size_t i=0; i < paths.size(); ++i) {
+		std::string prefix = clean(paths[i]);
+		//The parent of what is exported is not recreated under the target
+		size_t cut = prefix.rfind('/');
+		cut = cut == std::string::npos ? 0 : cut+1;
+		std::vector<std::string> l = fs.names(prefix);
+		for(std::vector<std::string>::const_iterator j = l.begin(); j != l.end(); ++j) {
+		    job_t job = {join(target.empty()?".":target, j->substr(cut)), *j, false};
+		    if(!job.path.empty() && job.path[job.path.size()-1] == '/') {
+			job.path.erase(job.path.size()-1);
+			job.dir = true;
+		    }
+		    jobs.push_back(job);
+		}
+	    }
+	} else {
+	    for(size_t i=0; i < paths.size(); ++i) {
+		std::string p = clean(paths[i]);
+		size_t cut = p.rfind('/');
+		walk(paths[i], join(clean(target), cut == std::string::npos ? p : p.substr(cut+1)));
+	    }
+	}
+
+	std::vector<pthread_t> workers(std::max(threads, (size_t)1));
+	for(size_t i=0; i < workers.size(); ++i)
+	    if(pthread_create(&workers[i], NULL, worker, NULL) != 0)
+		throw lsfs::ErrnoException(errno, __LINE__, __FILE__, "pthread_create");
+	for(size_t i=0; i < workers.size(); ++i)
+	    pthread_join(workers[i], NULL);
+	fs.umount();
+    } catch(po::error & e) {
+	std::cerr << e.what() << std::endl;
+	std::cerr << desc << std::endl;
+	return 1;
+    } catch(lsfs::InternalError & e) {
+	std::cerr << e.what() << std::endl;
+	return 1;
+    } catch(lsfs::ErrnoException & e) {
+	std::cerr << e.what() << std::endl;
+	return 1;
+    }
+    return failed == 0 ? 0 : 1;
+}
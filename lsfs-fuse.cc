@@ -1,6 +1,7 @@
 #define FUSE_USE_VERSION 26
 
 #include <fuse.h>
+#include <cstddef>
 #include <cstring>
 #include <lsfs.hh>
 #include <string>
@@ -18,6 +19,19 @@
 
 lsfs::FS fs;
 
+struct lsfs_config {
+  size_t readonly;
+  size_t compress;
+  size_t nodiscard;
+  unsigned long grow;     //MiB
+  unsigned long growlimit; //MiB
+  unsigned long hot;       //MiB
+  unsigned long hotdev;
+  int sync;                //lsfs::FS::Durability
+};
+
+lsfs_config conf;
+
 static int lsfs_mkdir(const char * path, mode_t) {
   try {
     lsfs::Handle h;
@@ -52,23 +66,19 @@ static int lsfs_getattr(const char *path, struct stat *stbuf)
       return 0;
     }
     
-    const std::set<std::string> &  l = fs.ls();
-    std::set<std::string>::const_iterator i = l.lower_bound(path+1);
-    if(i == l.end())
+    bool dir;
+    uint64_t size;
+    if(!fs.lookup(path+1, dir, size))
       return -ENOENT;
-    if(*i == (path+1)) {
+    if(!dir) {
       stbuf->st_mode = S_IFREG | 0777;
       stbuf->st_nlink = 1;
-      stbuf->st_size = fs.size(path+1);
+      stbuf->st_size = size;
       return 0;
     }
-    size_t x = strlen(path+1);
-    if(strncmp(path+1, i->c_str(), x) == 0 && i->c_str()[x] == '/') {
-      stbuf->st_mode = S_IFDIR | 0777;
-      stbuf->st_nlink = 2;
-      return 0;
-    }
-    return -ENOENT;
+    stbuf->st_mode = S_IFDIR | 0777;
+    stbuf->st_nlink = 2;
+    return 0;
   } HANDLE_EXCEPTIONS
 }
 
@@ -77,24 +87,11 @@ static int lsfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 		       off_t, struct fuse_file_info *)
 {
   try {
-    std::string prefix=path+1;
-    if(prefix != "") prefix.push_back('/');
-    const std::set<std::string> &  l = fs.ls();
-    std::set<std::string> files;
-    for(
-	std::set<std::string>::const_iterator i = l.lower_bound(prefix);
-	i != l.end();
-	++i) {
-      if(i->substr(0,prefix.size()) != prefix) break;
-      size_t e=i->find('/',prefix.size());
-      if(e != std::string::npos) e -= prefix.size();
-      std::string x = i->substr(prefix.size(),e);
-      if(x.size()) files.insert(x);
-    }
+    std::vector<std::string> files = fs.list(path+1);
     filler(buf, ".", NULL, 0);
     filler(buf, "..", NULL, 0);
-    for( std::set<std::string>::const_iterator i = files.begin(); i != files.end(); ++i)
-      filler(buf, i->c_str(), NULL, 0);
+    for(size_t i=0; i < files.size(); ++i)
+      filler(buf, files[i].c_str(), NULL, 0);
     return 0;
   } HANDLE_EXCEPTIONS
 }
@@ -102,14 +99,18 @@ static int lsfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 
 int lsfs_open(const char * path, struct fuse_file_info *fi) {
   try {
-    lsfs::Handle * h = fs.open(path+1,fi->flags & O_RDONLY);
+    lsfs::Handle * h = fs.open(path+1,(fi->flags & O_ACCMODE) == O_RDONLY);
     fi->fh = reinterpret_cast<size_t>(h);
     return 0;
   } HANDLE_EXCEPTIONS
 }
 
 int lsfs_create(const char * path, mode_t, struct fuse_file_info * fi) {
-  return lsfs_open(path,fi);
+  try {
+    lsfs::Handle * h = fs.open(path+1, false, NULL, conf.compress);
+    fi->fh = reinterpret_cast<size_t>(h);
+    return 0;
+  } HANDLE_EXCEPTIONS
 }
 
 int lsfs_read(const char *, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
@@ -131,6 +132,27 @@ int lsfs_write(const char *, const char *buf, size_t size, off_t offset, struct
   } HANDLE_EXCEPTIONS
 }
 
+//Called on every close of a descriptor, durable only with '-o sync=strict'
+int lsfs_flush(const char *, struct fuse_file_info * fi) {
+  try {
+    lsfs::Handle * h = reinterpret_cast<lsfs::Handle*>(static_cast<size_t>(fi->fh));
+    h->flush();
+    return 0;
+  } HANDLE_EXCEPTIONS
+}
+
+//Errors of this file come from sync. What went wrong in the background since
+//the last call, possibly with other files, is only logged
+int lsfs_fsync(const char *, int, struct fuse_file_info * fi) {
+  try {
+    lsfs::Handle * h = reinterpret_cast<lsfs::Handle*>(static_cast<size_t>(fi->fh));
+    h->sync();
+    std::string what;
+    if(fs.lastError(what) != 0) std::cerr << what << std::endl;
+    return 0;
+  } HANDLE_EXCEPTIONS
+}
+
 int lsfs_release(const char *, struct fuse_file_info * fi) {
   try {
     lsfs::Handle * h = reinterpret_cast<lsfs::Handle*>(static_cast<size_t>(fi->fh));
@@ -141,6 +163,30 @@ int lsfs_release(const char *, struct fuse_file_info * fi) {
 
 int lsfs_utimens(const char *, const struct timespec tv[2]) {return 0;} 
 
+static const char heatName[] = "user.lsfs.heat";
+
+//The heat of a file as "reads writes", in bytes
+int lsfs_getxattr(const char * path, const char * name, char * value, size_t size) {
+  try {
+    if(strcmp(name, heatName) != 0) return -ENODATA;
+    double reads, writes;
+    fs.heat(path+1, reads, writes);
+    char buf[64];
+    int n = snprintf(buf, sizeof(buf), "%.0f %.0f", reads, writes);
+    if(size == 0) return n;
+    if(size < (size_t)n) return -ERANGE;
+    memcpy(value, buf, n);
+    return n;
+  } HANDLE_EXCEPTIONS
+}
+
+int lsfs_listxattr(const char * path, char * list, size_t size) {
+  if(size == 0) return sizeof(heatName);
+  if(size < sizeof(heatName)) return -ERANGE;
+  memcpy(list, heatName, sizeof(heatName));
+  return sizeof(heatName);
+}
+
 int lsfs_truncate(const char * path, off_t size) {
   try {
     lsfs::Handle h;
@@ -157,17 +203,26 @@ enum {
   KEY_VERSION,
 };
 
-//#define MYFS_OPT(t, p, v) { t, offsetof(struct myfs_config, p), v }
+#define MYFS_OPT(t, p, v) { t, offsetof(struct lsfs_config, p), v }
 
 static struct fuse_opt myfs_opts[] = {
-  {"readonly", 0, 1},
-  {"-r", 0, 1},
-  {"--readonly", 0, 1},
+  MYFS_OPT("readonly", readonly, 1),
+  MYFS_OPT("-r", readonly, 1),
+  MYFS_OPT("--readonly", readonly, 1),
+  MYFS_OPT("compress", compress, 1),
+  MYFS_OPT("nodiscard", nodiscard, 1),
+  MYFS_OPT("grow=%lu", grow, 0),
+  MYFS_OPT("growlimit=%lu", growlimit, 0),
+  MYFS_OPT("hot=%lu", hot, 0),
+  MYFS_OPT("hotdev=%lu", hotdev, 0),
+  MYFS_OPT("sync=none", sync, lsfs::FS::syncNone),
+  MYFS_OPT("sync=periodic", sync, lsfs::FS::syncPeriodic),
+  MYFS_OPT("sync=strict", sync, lsfs::FS::syncStrict),
    FUSE_OPT_KEY("-V",             KEY_VERSION),
    FUSE_OPT_KEY("--version",      KEY_VERSION),
    FUSE_OPT_KEY("-h",             KEY_HELP),
    FUSE_OPT_KEY("--help",         KEY_HELP),
-   {NULL, -1 ,0}
+   FUSE_OPT_END
 };
 
 
@@ -184,7 +239,7 @@ static int lsfs_opt_proc(void *data, const char *arg, int key, struct fuse_args
     exit(0);
   case KEY_HELP:
     fprintf(stderr,
-	    "usage: %s device mountpoint [options]\n"
+	    "usage: %s device[,device...] mountpoint [options]\n"
 	    "\n"
 	    "general options:\n"
 	    "    -o opt,[opt...]  mount options\n"
@@ -195,6 +250,14 @@ static int lsfs_opt_proc(void *data, const char *arg, int key, struct fuse_args
 	    "    -o readonly\n"
 	    "    -r NUM           same as '-o readonly'\n"
 	    "    --readonly       same as '-o readonly'\n"
+	    "    -o compress      store newly created files compressed\n"
+	    "    -o nodiscard     do not punch holes in the devices for freed space\n"
+	    "    -o grow=MIB      grow full container files in steps of MIB\n"
+	    "    -o growlimit=MIB do not grow a container file beyond MIB\n"
+	    "    -o hot=MIB       pack the most read files into the first MIB of a device\n"
+	    "    -o hotdev=NUM    the device for '-o hot' (default 0)\n"
+	    "    -o sync=MODE     when to flush the devices besides fsync: none (default),\n"
+	    "                     periodic (every few seconds) or strict (before a change returns)\n"
 	    "\n"
 	    , outargs->argv[0]);
     fuse_opt_add_arg(outargs, "-ho");
@@ -210,11 +273,9 @@ static int lsfs_opt_proc(void *data, const char *arg, int key, struct fuse_args
   return 1;
 }
 
-size_t readonly;
-
 int main(int argc, char *argv[])
 {
-  readonly = 0;
+  memset(&conf, 0, sizeof(conf));
 
   memset(&lsfs_oper, 0, sizeof(struct fuse_operations));
   lsfs_oper.readdir = lsfs_readdir;
@@ -226,12 +287,32 @@ int main(int argc, char *argv[])
   lsfs_oper.open = lsfs_open;
   lsfs_oper.read = lsfs_read;
   lsfs_oper.write = lsfs_write;
+  lsfs_oper.flush = lsfs_flush;
+  lsfs_oper.fsync = lsfs_fsync;
   lsfs_oper.release = lsfs_release;
   lsfs_oper.utimens = lsfs_utimens;
   lsfs_oper.truncate = lsfs_truncate;
+  lsfs_oper.getxattr = lsfs_getxattr;
+  lsfs_oper.listxattr = lsfs_listxattr;
 
   struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
-  fuse_opt_parse(&args, &readonly, myfs_opts, lsfs_opt_proc);
-  fs.mount(dev,readonly);
+  fuse_opt_parse(&args, &conf, myfs_opts, lsfs_opt_proc);
+  if(dev == NULL) {
+    fprintf(stderr, "%s: missing device\n", argv[0]);
+    return 1;
+  }
+  std::vector<std::string> devs;
+  for(char * d = strtok(dev, ","); d != NULL; d = strtok(NULL, ","))
+    devs.push_back(d);
+  try {
+    fs.mount(devs,conf.readonly);
+    if(conf.nodiscard) fs.setDiscard(false);
+    if(conf.grow) fs.setGrowth((uint64_t)conf.grow << 20, (uint64_t)conf.growlimit << 20);
+    if(conf.hot) fs.setHotRegion(conf.hotdev, (uint64_t)conf.hot << 20);
+    fs.setDurability(static_cast<lsfs::FS::Durability>(conf.sync));
+  } catch(const std::exception & e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
   return fuse_main(args.argc, args.argv, &lsfs_oper, NULL);
 }
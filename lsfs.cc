@@ -4,14 +4,22 @@
 //it can be mounted read only, however a file can be pulled from under your feed 
 //while it is open, so learn to live with it..
 
-//When filesystem is mounted readonly... create inotify
+//When filesystem is mounted readonly, inotify on the file table tells
+//when to pick up the slots the writer changed
 #include "lsfs.hh"
+#include "lz.hh"
 #include <cstring>
 #include <unistd.h>
+#include <sys/inotify.h>
 #include <sys/types.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <algorithm>
 #include <cassert>
+#include <cstddef>
+#include <cmath>
+#include <ctime>
 #include <iostream>
 #include <memory>
 
@@ -30,6 +38,58 @@ namespace {
 	void release() {x=-1;}
     };
     const uint64_t magic = 0xCAFEBABEDEADBEEFll;
+    const uint64_t version = 2;
+    const uint64_t flagCompressed = 1;
+    const uint64_t blockSize = 64*1024;
+    const uint64_t mapSize = 4096;     //Smallest block map of a compressed file, in bytes
+    const uint64_t stripeSize = 1024*1024;
+    const uint64_t parallelSize = 128*1024;  //Smallest transfer worth a thread per device
+    const uint64_t bounceSize = 1024*1024;
+    const uint64_t regionSize = 16*1024*1024;
+    const uint64_t discardBatch = 64*1024*1024;
+    const int maintenanceInterval = 5; //Seconds
+    const uint64_t ringSize = 64;      //Changed slots remembered in the header
+    const int refreshAttempts = 3;
+
+    //Chunk addresses carry the device in their top bits
+    const int deviceShift = 56;
+    inline uint64_t deviceOf(uint64_t a) {return a >> deviceShift;}
+    inline uint64_t offsetOf(uint64_t a) {return a & ((1ull << deviceShift) - 1);}
+    inline uint64_t address(uint64_t device, uint64_t offset) {return (device << deviceShift) | offset;}
+    const uint64_t minReadahead = 128*1024;
+    const int arenaPageShift = 16;     //Chunks per arena page, at least
+    const double heatHalfLife = 600;   //Seconds
+    const double hotThreshold = 1;     //Times a file is read over in a half life to count as hot
+    const uint64_t relocateBatch = 64*1024*1024;  //Moved per maintenance pass
+    const uint32_t scanBatch = 4096;   //Slots looked at per lock hold
+    const int retireGrace = 3*maintenanceInterval;  //Seconds moved away space is left alone for other mounts
+
+    inline uint64_t seconds() {
+	timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec;
+    }
+
+    //The errno to report an exception as
+    inline int errnoOf(const std::exception & e) {
+	const lsfs::ErrnoException * ee = dynamic_cast<const lsfs::ErrnoException *>(&e);
+	const lsfs::InternalError * ie = dynamic_cast<const lsfs::InternalError *>(&e);
+	return ee != NULL ? ee->number : ie != NULL ? ie->number : EIO;
+    }
+
+    //Blocks of chunks come in powers of two, class n holds up to 1 << n
+    inline int sizeClass(uint64_t count) {
+	int n=0;
+	while((1ull << n) < count) ++n;
+	return n;
+    }
+    const uint64_t maxReadahead = 8*1024*1024;
+
+    //Striping unit for the n-th chunk of a file. Units double every per
+    //chunks, so large files do not run out of chunk slots
+    inline uint64_t unitSize(uint64_t n, uint64_t per) {
+	return stripeSize << std::min(n / per, (uint64_t)16);
+    }
 
     struct lock {
 	pthread_mutex_t * m;
@@ -47,6 +107,22 @@ namespace {
 	uint64_t files;
 	uint64_t maxfiles;
 	uint64_t maxchunks;
+	uint64_t id;      //Shared by all devices of a filesystem
+	uint64_t devices;
+	uint64_t device;  //Only device 0 holds the file table
+	uint64_t generation;          //Bumped for every file slot written
+	uint64_t changes[ringSize];   //The slot written at generation g is in changes[g % ringSize]
+    };
+
+    //Version 1 had a single device and a header ending at maxchunks
+    struct header1_t {
+	uint64_t magic;
+	uint64_t version;
+	uint64_t writemounted;
+	uint64_t writing;
+	uint64_t files;
+	uint64_t maxfiles;
+	uint64_t maxchunks;
     };
     
     struct chunk_t {
@@ -55,59 +131,289 @@ namespace {
     };
     
     struct file_t {
+	char name[1024];
+	uint64_t flags;
+	uint64_t size;
+	uint64_t reset;   //Generation of the last create or shrink of a compressed file
+	uint64_t blocks;  //Stored blocks of a compressed file
+	chunk_t map;      //Extent holding the stored offset of each of those blocks
+	uint64_t chunkCount;
+	chunk_t chunks[0];
+    };
+
+    //Version 1 slots, without flags, size and the block map
+    struct file1_t {
 	char name[1024];
 	uint64_t chunkCount;
 	chunk_t chunks[0];
     };
+
+    //A compressed file is stored as a sequence of blocks, each compressing
+    //blockSize bytes (less for the last) and preceded by this header
+    struct block_t {
+	uint32_t stored; //Bytes following the header, equal to size when the block is kept raw
+	uint32_t size;
+    };
 #pragma pack(pop)
+
+    //Unpack a stored block, data holds its header and at least what follows
+    void decodeBlock(const uint8_t * data, uint64_t size, std::vector<uint8_t> & out) {
+	const block_t * hdr = reinterpret_cast<const block_t*>(data);
+	if(size < sizeof(block_t) || hdr->size > blockSize || hdr->stored > hdr->size || sizeof(block_t) + hdr->stored > size)
+	    THROW_E("Corrupt block header");
+	out.resize(hdr->size);
+	if(hdr->stored == hdr->size)
+	    memcpy(&out[0], data + sizeof(block_t), hdr->size);
+	else if(lsfs::lz::decompress(data + sizeof(block_t), hdr->stored, &out[0], hdr->size) != hdr->size)
+	    THROW_E("Corrupt compressed block");
+    }
+
+    //Turn a version 1 slot into a file_t in place and back, buf holds a full file_t
+    const size_t slotGap = offsetof(file_t, chunkCount) - offsetof(file1_t, chunkCount);
+    void widen(uint8_t * buf, uint64_t maxchunks) {
+	memmove(buf + offsetof(file_t, chunkCount), buf + offsetof(file1_t, chunkCount), sizeof(uint64_t) + sizeof(chunk_t)*maxchunks);
+	memset(buf + offsetof(file1_t, chunkCount), 0, slotGap);
+    }
+    void narrow(uint8_t * buf, uint64_t maxchunks) {
+	memmove(buf + offsetof(file1_t, chunkCount), buf + offsetof(file_t, chunkCount), sizeof(uint64_t) + sizeof(chunk_t)*maxchunks);
+    }
+
+    struct piece_t {
+	uint64_t address;
+	uint8_t * buf;
+	uint64_t size;
+	piece_t(uint64_t a, uint8_t * b, uint64_t s): address(a), buf(b), size(s) {}
+    };
+
+    struct worker_t {
+	const std::vector<int> * fds;
+	std::vector<piece_t> pieces;
+	bool write;
+	int error;
+    };
+
+    void * transferPieces(void * arg) {
+	worker_t * w = reinterpret_cast<worker_t*>(arg);
+	w->error = 0;
+	for(size_t i=0; i < w->pieces.size(); ++i) {
+	    const piece_t & p = w->pieces[i];
+	    int fd = (*w->fds)[deviceOf(p.address)];
+	    ssize_t x = w->write?
+		pwrite(fd, p.buf, p.size, offsetOf(p.address)):
+		pread(fd, p.buf, p.size, offsetOf(p.address));
+	    if(x != (ssize_t)p.size) {
+		w->error = x == -1 ? errno : EIO;
+		break;
+	    }
+	}
+	return NULL;
+    }
+
+    //Copy between two descriptors inside the kernel where possible, otherwise through a buffer
+    void copyRange(int in, uint64_t inoff, int out, uint64_t outoff, uint64_t size) {
+	while(size > 0) {
+	    loff_t i = inoff, o = outoff;
+	    ssize_t r = copy_file_range(in, &i, out, &o, size, 0);
+	    if(r == -1 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) break;
+	    if(r == -1) THROW_ERRNO("copy_file_range");
+	    if(r == 0) THROW_ERRNOG(EIO, "Unexpected end of file");
+	    inoff += r;
+	    outoff += r;
+	    size -= r;
+	}
+	if(size == 0) return;
+	std::vector<uint8_t> buf(std::min(size, bounceSize));
+	while(size > 0) {
+	    ssize_t r = pread(in, &buf[0], std::min(size, (uint64_t)buf.size()), inoff);
+	    if(r == -1) THROW_ERRNO("pread");
+	    if(r == 0) THROW_ERRNOG(EIO, "Unexpected end of file");
+	    if(pwrite(out, &buf[0], r, outoff) != r) THROW_ERRNO("pwrite");
+	    inoff += r;
+	    outoff += r;
+	    size -= r;
+	}
+    }
+
+    //Perform the pieces of a read or write, large transfers spanning several
+    //devices get a thread per device
+    void transfer(const std::vector<int> & fds, const std::vector<piece_t> & pieces, bool write) {
+	std::vector<worker_t> workers(fds.size());
+	uint64_t total=0;
+	size_t used=0;
+	for(size_t i=0; i < pieces.size(); ++i) {
+	    worker_t & w = workers[deviceOf(pieces[i].address)];
+	    if(w.pieces.empty()) ++used;
+	    w.pieces.push_back(pieces[i]);
+	    total += pieces[i].size;
+	}
+	for(size_t i=0; i < workers.size(); ++i) {
+	    workers[i].fds = &fds;
+	    workers[i].write = write;
+	}
+	if(used < 2 || total < parallelSize) {
+	    for(size_t i=0; i < workers.size(); ++i) {
+		transferPieces(&workers[i]);
+		if(workers[i].error) THROW_ERRNOG(workers[i].error, write?"pwrite":"pread");
+	    }
+	    return;
+	}
+	std::vector<pthread_t> threads(workers.size());
+	std::vector<bool> started(workers.size(), false);
+	size_t first = workers.size();
+	for(size_t i=0; i < workers.size(); ++i) {
+	    if(workers[i].pieces.empty()) continue;
+	    if(first == workers.size()) {first = i; continue;}
+	    started[i] = pthread_create(&threads[i], NULL, transferPieces, &workers[i]) == 0;
+	    if(!started[i]) transferPieces(&workers[i]);
+	}
+	transferPieces(&workers[first]);
+	for(size_t i=0; i < workers.size(); ++i)
+	    if(started[i]) pthread_join(threads[i], NULL);
+	for(size_t i=0; i < workers.size(); ++i)
+	    if(workers[i].error) THROW_ERRNOG(workers[i].error, write?"pwrite":"pread");
+    }
+
+    struct flusher_t {
+	int fd;
+	int error;
+    };
+
+    void * flushDevice(void * arg) {
+	flusher_t * f = reinterpret_cast<flusher_t*>(arg);
+	f->error = fdatasync(f->fd) == -1 ? errno : 0;
+	return NULL;
+    }
+
+    //fdatasync all devices at the same time, returns the first error
+    int flushDevices(const std::vector<int> & fds) {
+	std::vector<flusher_t> flushers(fds.size());
+	std::vector<pthread_t> threads(fds.size());
+	std::vector<bool> started(fds.size(), false);
+	for(size_t i=0; i < fds.size(); ++i) {
+	    flushers[i].fd = fds[i];
+	    if(i == 0) continue;
+	    started[i] = pthread_create(&threads[i], NULL, flushDevice, &flushers[i]) == 0;
+	    if(!started[i]) flushDevice(&flushers[i]);
+	}
+	if(!fds.empty()) flushDevice(&flushers[0]);
+	for(size_t i=0; i < fds.size(); ++i)
+	    if(started[i]) pthread_join(threads[i], NULL);
+	for(size_t i=0; i < fds.size(); ++i)
+	    if(flushers[i].error) return flushers[i].error;
+	return 0;
+    }
 }
 
 namespace lsfs {
     
     void FS::mount(const std::string & path, bool readOnly, bool ignorewm) {
-	this->path = path;
-	filelist.clear();
-	files.clear();
+	mount(std::vector<std::string>(1, path), readOnly, ignorewm);
+    }
+
+    void FS::mount(const std::vector<std::string> & paths, bool readOnly, bool ignorewm) {
+	if(paths.empty()) THROW_ERRNOG(EINVAL,"No devices given");
+	umount();
+	this->paths = paths;
+	this->readonly = readOnly;
+	delete root;
+	root = new Dir(NULL, NULL);
+	freespace.clear();
+	slots.clear();
 	
-	fdw fd = getFd();
+	//The devices may be given in any order, the headers tell where they belong
 	header_t header;
-	if(lseek(fd,0,SEEK_SET) == -1) THROW_ERRNO("lseek");
-	if(read(fd,&header,sizeof(header_t)) != sizeof(header_t)) THROW_ERRNOG(EINVAL,"read");
-	if(header.magic != magic || header.version != 1) 
-	    THROW_ERRNOG(EINVAL,"Wrong header or magic");
+	fds.assign(paths.size(), -1);
+	sizes.assign(paths.size(), 0);
+	growable.assign(paths.size(), false);
+	discards.clear();
+	discarded = 0;
+	held.clear();
+	pinned.clear();
+	retired.clear();
+	heats.clear();
+	for(size_t d=0; d < paths.size(); ++d) {
+	    fdw fd = ::open(paths[d].c_str(), O_NOATIME | (readOnly?O_RDONLY:O_RDWR));
+	    if(fd == -1) THROW_ERRNO("Unable to open file '%s'",paths[d].c_str());
+	    header_t h;
+	    memset(&h, 0, sizeof(h));
+	    ssize_t got = pread(fd,&h,sizeof(header_t),0);
+	    if(got < (ssize_t)sizeof(header1_t)) THROW_ERRNOG(EINVAL,"read");
+	    if(h.magic != magic || (h.version != version && h.version != 1) || (h.version == version && got != sizeof(header_t)))
+		THROW_ERRNOG(EINVAL,"Wrong header or magic on '%s'",paths[d].c_str());
+	    if(h.version == 1) {
+		//Mounted as it is, the header is written back in the old layout
+		memset(reinterpret_cast<uint8_t*>(&h) + sizeof(header1_t), 0, sizeof(header_t) - sizeof(header1_t));
+		h.devices = 1;
+	    }
+	    if(h.devices != paths.size() || h.device >= paths.size() || fds[h.device] != -1 || (d != 0 && h.id != header.id))
+		THROW_ERRNOG(EINVAL,"'%s' does not belong to this filesystem",paths[d].c_str());
+	    off_t size = lseek(fd,0,SEEK_END);
+	    if(size == -1) THROW_ERRNO("lseek failed");
+	    struct stat st;
+	    if(fstat(fd,&st) == -1) THROW_ERRNO("fstat failed");
+	    if(d == 0 || h.device == 0) header = h;
+	    if(h.device == 0 && readOnly) {
+		inotifyfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if(inotifyfd != -1 && inotify_add_watch(inotifyfd, paths[d].c_str(), IN_MODIFY) == -1) {
+		    ::close(inotifyfd);
+		    inotifyfd = -1;
+		}
+	    }
+	    sizes[h.device] = size;
+	    growable[h.device] = S_ISREG(st.st_mode);
+	    fds[h.device] = fd;
+	    fd.release();
+	}
+	legacy = header.version == 1;
+	tableStart = legacy ? sizeof(header1_t) : sizeof(header_t);
+	id = header.id;
+	generation = header.generation;
+	changes.assign(header.changes, header.changes + ringSize);
+	stale = false;
 	
 	maxchunks = header.maxchunks;
 	maxfiles = header.maxfiles;
-	filesize = sizeof(file_t) + sizeof(chunk_t) * header.maxchunks;
+	filesize = (legacy ? sizeof(file1_t) : sizeof(file_t)) + sizeof(chunk_t) * header.maxchunks;
+	arena.reset(maxchunks);
 	
 	freespace_t used;
 	
-	uint8_t buf[filesize];
+	uint8_t buf[sizeof(file_t) + sizeof(chunk_t) * maxchunks];
 	file_t * f = reinterpret_cast<file_t*>(buf);
 
 	for(size_t i=0; i < header.files; ++i) {
-	    if(read(fd,buf,filesize) != filesize) THROW_ERRNOG(EINVAL,"Error reading file table"); 
-	    File * file = new File();
-	    file->name = f->name;
-	    file->usage = 1;
+	    if(pread(fds[0],buf,filesize,tableStart + i*filesize) != filesize) THROW_ERRNOG(EINVAL,"Error reading file table"); 
+	    if(legacy) widen(buf, maxchunks);
+	    f->name[sizeof(f->name)-1] = 0;
+	    File * file = File::create(&arena, f->name);
 	    file->index = i;
+	    file->flags = f->flags;
+	    if(f->flags & flagCompressed) {
+		file->compressed = new Compressed();
+		file->compressed->length = f->size;
+		file->compressed->reset = f->reset;
+		file->compressed->stored = f->blocks;
+		file->compressed->map = std::make_pair(f->map.start, f->map.end);
+		if(f->map.start != f->map.end) used.insert(file->compressed->map);
+	    }
 	    for(size_t j=0; j < f->chunkCount; ++j) {
 		file->chunks.push_back( std::make_pair( f->chunks[j].start, f->chunks[j].end) );
 		used.insert( std::make_pair( f->chunks[j].start, f->chunks[j].end) );
 	    }
-	    filelist.insert(file->name);
-	    files[file->name] = file;
+	    insert(file, f->name);
+	    slots.push_back(file);
+	}
+	used.insert( std::make_pair(0,tableStart + maxfiles*filesize));
+	for(size_t d=0; d < fds.size(); ++d) {
+	    if(d != 0) used.insert( std::make_pair(address(d,0), address(d,sizeof(header_t))) );
+	    used.insert( std::make_pair(address(d,sizes[d]), address(d,sizes[d])) );
 	}
-	off_t size = lseek(fd,0,SEEK_END);
-	if(size == -1) THROW_ERRNO("lseek failed");
-	used.insert( std::make_pair(0,sizeof(header_t) + maxfiles*filesize));
-	used.insert( std::make_pair(size,size) );
 	
 	freespace_t::iterator o=used.begin();
 	freespace_t::iterator i=o;
 	//std::cout << "Free space:" << std::endl;
 	for(++i; i != used.end(); ++i) {
-	    if(o->second != i->first) {
+	    if(o->second != i->first && deviceOf(o->second) == deviceOf(i->first)) {
 		//std::cout << "   " << o->second << " " << i->first << std::endl;
 		freespace.insert( std::make_pair(o->second, i->first) );
 	    }
@@ -115,282 +421,1858 @@ namespace lsfs {
 	}
     }
     
+    ChunkArena::ChunkArena(): used(0), pageShift(arenaPageShift) {}
+
+    ChunkArena::~ChunkArena() {
+	reset(0);
+    }
+
+    void ChunkArena::reset(uint64_t largest) {
+	for(size_t i=0; i < pages.size(); ++i)
+	    delete[] pages[i];
+	pages.clear();
+	used = 0;
+	pageShift = std::max(arenaPageShift, sizeClass(largest));
+	free.assign(pageShift+1, std::vector<uint64_t>());
+    }
+
+    //Put [from, to) on the free lists, as aligned blocks
+    void ChunkArena::spill(uint64_t from, uint64_t to) {
+	while(from < to) {
+	    int n=0;
+	    while(n < pageShift && (from & (1ull << n)) == 0 && from + (2ull << n) <= to) ++n;
+	    free[n].push_back(from);
+	    from += 1ull << n;
+	}
+    }
+
+    uint64_t ChunkArena::allocate(int size) {
+	if(size >= (int)free.size()) THROW_E("Too many chunks");
+	if(!free[size].empty()) {
+	    uint64_t b = free[size].back();
+	    free[size].pop_back();
+	    return b;
+	}
+	//Blocks are aligned to their size, so they never straddle two pages
+	uint64_t n = 1ull << size;
+	uint64_t start = (used + n - 1) & ~(n - 1);
+	spill(used, start);
+	if(start + n > (pages.size() << pageShift))
+	    pages.push_back(new std::pair<uint64_t,uint64_t>[1ull << pageShift]);
+	used = start + n;
+	return start;
+    }
+
+    void ChunkArena::release(uint64_t block, int size) {
+	free[size].push_back(block);
+    }
+
+    void Chunks::resize(size_t size) {
+	if(size == count) return;
+	if(size == 0) {
+	    arena->release(block, sizeClass(count));
+	    count = 0;
+	    return;
+	}
+	int from = sizeClass(count), to = sizeClass(size);
+	if(count == 0 || from != to) {
+	    uint64_t b = arena->allocate(to);
+	    for(size_t i=0; i < std::min((size_t)count, size); ++i)
+		arena->at(b+i) = arena->at(block+i);
+	    if(count != 0) arena->release(block, from);
+	    block = b;
+	}
+	for(size_t i=count; i < size; ++i)
+	    arena->at(block+i) = std::make_pair(0, 0);
+	count = size;
+    }
+
+    void Chunks::push_back(const std::pair<uint64_t,uint64_t> & chunk) {
+	std::pair<uint64_t,uint64_t> c = chunk;
+	resize(count+1);
+	back() = c;
+    }
+
+    void Chunks::assign(const std::vector<std::pair<uint64_t,uint64_t> > & chunks) {
+	resize(chunks.size());
+	for(size_t i=0; i < chunks.size(); ++i)
+	    (*this)[i] = chunks[i];
+    }
+
+    bool Chunks::operator==(const std::vector<std::pair<uint64_t,uint64_t> > & chunks) {
+	if(count != chunks.size()) return false;
+	for(size_t i=0; i < chunks.size(); ++i)
+	    if((*this)[i] != chunks[i]) return false;
+	return true;
+    }
+
+    File::File(ChunkArena * arena): dir(NULL), index(0), usage(1), flags(0), layout(0),
+				    error(0), chunks(arena), compressed(NULL) {}
+
+    //Files are allocated with room for the last component of their name
+    File * File::create(ChunkArena * arena, const std::string & name) {
+	size_t i = name.rfind('/');
+	i = i == std::string::npos ? 0 : i+1;
+	void * m = ::operator new(std::max(sizeof(File), offsetof(File, leaf) + name.size() - i + 1));
+	File * file = new(m) File(arena);
+	memcpy(file->leaf, name.c_str() + i, name.size() - i + 1);
+	return file;
+    }
+
+    void File::operator delete(void * p) {
+	::operator delete(p);
+    }
+
+    File::~File() {
+	delete compressed;
+    }
+
+    std::string File::name() {
+	if(dir == NULL) return std::string();
+	std::string res = leaf;
+	for(Dir * d=dir; d->name != NULL; d=d->parent)
+	    res = *d->name + "/" + res;
+	return res;
+    }
+
     uint64_t File::size() {
+	if(compressed) return compressed->length;
+	return allocated();
+    }
+
+    uint64_t File::allocated() {
 	uint64_t res=0;
 	for(size_t i=0; i < chunks.size(); ++i)
 	    res += chunks[i].second - chunks[i].first;
 	return res;
     }
 
+    //Never throws, so the destructor can use it. A tail that cannot be stored
+    //is kept on the file for the next flush or sync of it, a failed flush in
+    //strict mode is reported through FS::lastError. The file is let go of all
+    //the same
     void Handle::close() {
-	if(fd != -1) ::close(fd);
-	fd=-1;
-	if(file != NULL) fs->unuse(file);
+	if(file == NULL) return;
+	lock l(&fs->mutex);
+	if(!fs->readonly) {
+	    try {
+		if(file->flags & flagCompressed) flushTail();
+	    } catch(const std::exception & e) {
+		if(file->error == 0) file->error = errnoOf(e);
+		fs->fail(e);
+	    }
+	    if(!readOnly) fs->unwrite(file);
+	}
+	fs->unuse(file);
 	file = NULL;
+	if(readOnly) return;
+	try {
+	    fs->commit();
+	} catch(const std::exception & e) {
+	    fs->fail(e);
+	}
     }
 
-    Handle::Handle(): file(NULL),fd(-1), fs(NULL) {};
+    Handle::Handle(): file(NULL), fs(NULL) {};
     Handle::~Handle() {close();}
 
-    inline void Handle::seekset() {
-	if(chunk == (uint64_t)-1) return; 
-	//std::cout << file->chunks.size() << " " << chunk << " " << cl << " " << file->chunks[chunk].first+cl << std::endl;
-	if(lseek(fd,file->chunks[chunk].first+cl, SEEK_SET) == -1) THROW_ERRNO("lseek");
-    }
-    
     void Handle::seek(uint64_t where) {
-	lock l(&this->fs->mutex, !this->fs->readonly);
+	lock l(&this->fs->mutex);
+	revalidate();
+	locate(where);
+    }
+
+    void Handle::locate(uint64_t where) {
+	pos = where;
+	if(file->flags & flagCompressed) {
+	    if(where > file->compressed->length) THROW_ERRNOG(EINVAL,"Bad location");
+	    return;
+	}
 	if(where == 0 && file->chunks.empty()) return;
 	cl = where;
 	for(chunk=0; chunk < file->chunks.size(); ++chunk) {
 	    size_t s = file->chunks[chunk].second - file->chunks[chunk].first;
 	    if(s <= cl) {cl -= s; continue;}
-	    seekset();
 	    return;
 	}
 	if(cl != 0) THROW_ERRNOG(EINVAL,"Bad location");
 	chunk=(uint64_t)-1;
     }
 
+    //Pick up what the writer changed on a read only mount, then catch up with
+    //a refresh that replaced the chunks of the file. A position beyond the new
+    //end moves to the end
+    void Handle::revalidate() {
+	fs->refresh();
+	if(layout == file->layout) return;
+	layout = file->layout;
+	cacheBlock = (uint64_t)-1;
+	rawindow = 0;
+	raend = pos;
+	if(file->flags & flagCompressed) {
+	    //Readahead of compressed files goes by the stored bytes
+	    raend = 0;
+	    if(file->compressed->blocks.size() < file->compressed->stored) fs->loadBlocks(file);
+	    return;
+	}
+	locate(std::min(pos, file->size()));
+    }
+
+
+    uint64_t Handle::tell() {
+	return pos;
+    }
 
     void Handle::allocate(uint64_t size) {
 	if(size == 0) return;
 	//std::cout << ">> Allocate(" << size << ")" << std::endl;
 	//std::cout << file->chunks.size() << " " << chunk << std::endl;
-	if(file->chunks.size() > 0) { //Try to expand the last chunk
-	    uint64_t p = file->chunks.back().second;
-	    freespace_t::iterator i = fs->freespace.lower_bound( std::make_pair(p,p) );
-	    if(i != fs->freespace.end() && i->first == p) { 
-		//Great we can extend the last chunk;
-		uint64_t start=i->first;
-		uint64_t end=i->second;
-		fs->freespace.erase(i);
-		uint64_t s = std::min(end-start,size);
-		file->chunks.back().second += s;
-		size -= s;
-		if(start+s != end) fs->freespace.insert(std::make_pair(start+s,end));
+	//With several devices a file is laid out in units taking turns on the
+	//devices, however it is written, so reads draw on all of them
+	uint64_t devices = fs->fds.size();
+	if(devices > 1) {
+	    uint64_t per = std::max(devices, fs->maxchunks / 8);
+	    //Two chunk slots are kept for whatever does not fit
+	    while(size > 0 && file->chunks.size() + 2 < fs->maxchunks) {
+		uint64_t n = file->chunks.size();
+		uint64_t piece = std::min(size, unitSize(n, per));
+		uint64_t device;
+		if(n == 0) device = fs->stripe++ % devices;
+		else {
+		    uint64_t have = file->chunks.back().second - file->chunks.back().first;
+		    uint64_t unit = unitSize(n-1, per);
+		    device = deviceOf(file->chunks.back().first);
+		    if(have < unit) {
+			//Fill up the last unit, on its device
+			uint64_t s = fs->extend(file, std::min(size, unit - have));
+			size -= s;
+			if(s != 0) continue;
+			piece = std::min(size, unit - have);
+		    } else
+			device = (device + 1) % devices;
+		}
+		uint64_t start;
+		freespace_t::iterator best = fs->place(file, device, piece, start);
+		if(best == fs->freespace.end()) best = fs->place(file, (uint64_t)-1, piece, start);
+		if(best == fs->freespace.end()) break;
+		size -= fs->take(file, best, start, piece);
 	    }
-	}
+	} else if(file->chunks.size() > 0)
+	    size -= fs->extend(file, size);
 	//std::cout << file->chunks.size() << " " << chunk << std::endl;
+	bool grown = false;
 	while(size > 0) {
 	    // std::cout << " .." << std::endl;
-	    freespace_t::iterator best=fs->freespace.begin();
-	    for(freespace_t::iterator i=best; i != fs->freespace.end(); ++i)
-		if(i->second - i->first > best->second - best->first) best=i;
-	    if(best == fs->freespace.end()) {
-		fs->writeFile(fd, file);
+	    //The last chunk slot has to take all that is left
+	    bool last = file->chunks.size() + 1 >= fs->maxchunks;
+	    uint64_t start;
+	    freespace_t::iterator best=fs->place(file, (uint64_t)-1, size, start, last);
+	    //Grow the container once rather than fail, or spend the last chunk slot on a piece too small
+	    if(!grown && (best == fs->freespace.end() || (last && best->second - start < size)) && fs->grow(size)) {
+		grown = true;
+		continue;
+	    }
+	    if(best == fs->freespace.end() || file->chunks.size() == fs->maxchunks) {
+		fs->writeFile(file);
 		THROW_ERRNOG(ENOSPC, "No space left on device");
 	    }
-	    uint64_t start=best->first;
-	    uint64_t end=best->second;
-	    fs->freespace.erase(best);
-	    uint64_t s = std::min(end-start,size);
-	    file->chunks.push_back(std::make_pair(start, start+s) );
-	    size -= s;
-	    if(start+s != end) fs->freespace.insert(std::make_pair(start+s,end));
+	    size -= fs->take(file, best, start, size);
 	}
 	//std::cout << file->chunks.size() << " " << chunk << std::endl;
-	fs->writeFile(fd, file);
+	fs->writeFile(file);
 	//std::cout << "<< Allocate" << std::endl;
     }
     
     void Handle::truncate(uint64_t size) {
 	if(readOnly || this->fs->readonly) THROW_ERRNOG(EROFS, "Readonly file or fs");
 	lock l(&this->fs->mutex);
+	fs->touch(file, 0, true);
 	//std::cout << ">>truncate " << fd << " " << size<< std::endl;
-	size_t c=0;
-	while(size > 0 && c < file->chunks.size()) {
-	    std::pair<uint64_t, uint64_t> & cc = file->chunks[c];
-	    size_t s = cc.second - cc.first;
-	    c++;
-	    if(size > s) {size-=s; continue;}
-	    if(size == 0) break;
-	    fs->freespace.insert( std::make_pair(cc.first+size, cc.second) );
-	    cc.second = cc.first+size;
-	    break;
-	}
-	for(int i=c;i < file->chunks.size(); ++i) {
-	    std::pair<uint64_t, uint64_t> & cc = file->chunks[i];
-	    fs->freespace.insert( std::make_pair(cc.first, cc.second) );
+	if(file->flags & flagCompressed) {
+	    truncateCompressed(size);
+	    fs->commit();
+	    return;
 	}
-	file->chunks.resize(c);
-	fs->compressFreeSpace();
-
+	size = fs->cut(file, size);
 	if(size > 0) allocate(size);
-	else fs->writeFile(fd, file);
+	else fs->writeFile(file);
 	chunk = (uint64_t)-1;
 	cl = 0;
-	if(file->chunks.size() > 0) {
-	    if(lseek(fd,file->chunks[0].first,SEEK_SET) == -1) THROW_PE("lseek");
-	    chunk = 0;
-	}
+	pos = 0;
+	if(file->chunks.size() > 0) chunk = 0;
+	fs->commit();
 	//std::cout << "<<truncate" << std::endl;
     }
 
     Handle::Handle(const Handle & h) {
 	file = h.file;
-	if(file != NULL) file->usage++;
-	fd = h.fd==-1?-1:dup(h.fd);
 	fs = h.fs;
+	readOnly = h.readOnly;
+	if(file != NULL) {
+	    lock l(&fs->mutex);
+	    file->usage++;
+	    if(!readOnly && !fs->readonly) fs->writers[file]++;
+	}
 	cl = h.cl;
 	chunk = h.chunk;
+	pos = h.pos;
+	rapos = h.rapos;
+	raend = h.raend;
+	rawindow = h.rawindow;
+	cacheBlock = (uint64_t)-1;
+	layout = h.layout;
     }
 
-    uint64_t Handle::read(uint8_t * buf, uint64_t size) {
-	lock l(&this->fs->mutex, !this->fs->readonly);
-	
-	//std::cout << ">>Read" << std::endl;
-	uint64_t read=0;
-	while(size > 0) {
-	    if(chunk == (uint64_t)-1) break;
-	    uint64_t cr=file->chunks[chunk].second-file->chunks[chunk].first-cl;
-	    uint64_t r = std::min(size,cr);
-	    if(::read(fd,buf,r) != r) THROW_PE("read");
-	    size -= r;
-	    buf += r;
-	    read += r;
-	    if(r < cr) {cl -= r; break;}
-	    chunk++;
-	    if(chunk == file->chunks.size()) {chunk=(uint64_t)-1; break;}
-	    cl = 0;
-	    if(lseek(fd,file->chunks[chunk].first,SEEK_SET) == -1) THROW_PE("lseek");
+    void Handle::readahead(uint64_t size) {
+	if(pos != rapos) {
+	    //Not a continuation of the last read, collapse the window
+	    rawindow = 0;
+	    raend = pos;
+	    return;
 	}
-	//std::cout << "<<Read" << std::endl;
-	return read;
+	if(chunk == (uint64_t)-1) return;
+	rawindow = rawindow == 0 ? minReadahead : std::min(rawindow*2, maxReadahead);
+	uint64_t end = pos + size + rawindow;
+	//Only top up when half of the window has been consumed
+	if(raend >= pos + size + rawindow/2) return;
+	uint64_t from = std::max(raend, pos);
+	//Walk the extents in logical order, so the start of the next chunk
+	//is fetched before the read crosses the boundary
+	uint64_t l = pos;
+	for(uint64_t c=chunk, o=cl; c < file->chunks.size() && l < end; ++c, o=0) {
+	    uint64_t s = file->chunks[c].second - file->chunks[c].first - o;
+	    uint64_t a = std::max(l, from);
+	    uint64_t b = std::min(l+s, end);
+	    if(a < b) {
+		uint64_t p = file->chunks[c].first + o + (a-l);
+		posix_fadvise(fs->fds[deviceOf(p)], offsetOf(p), b-a, POSIX_FADV_WILLNEED);
+	    }
+	    l += s;
+	}
+	raend = std::max(raend, std::min(end, l));
     }
-    
-    void Handle::write(const uint8_t * buf, uint64_t size) {
-	if(readOnly || this->fs->readonly) THROW_ERRNOG(EROFS, "Readonly file or fs");
-	lock l(&this->fs->mutex);
-	//std::cout << ">>Write " << chunk << " "  << size << std::endl;
+
+    //Map the next size bytes of the file to device addresses and advance the
+    //position past them, growing the file when extend is set
+    uint64_t Handle::map(uint64_t size, std::vector<std::pair<uint64_t,uint64_t> > & extents, bool extend) {
+	uint64_t mapped=0;
 	while(size > 0) {
-	    //std::cout << "  .. " << chunk << " "  << size << std::endl;
 	    if(chunk == (uint64_t)-1) {
+		if(!extend) break;
 		chunk = file->chunks.size();
 		uint64_t end=0;
 		if(chunk > 0) end=file->chunks[chunk-1].second;
-		allocate(size);
+		try {
+		    allocate(size);
+		} catch(...) {
+		    //Part of it may have been allocated, find the position again
+		    locate(pos);
+		    throw;
+		}
 		cl=0;
 		if(chunk > 0 && file->chunks[chunk-1].second > end ) {
 		    --chunk;
 		    cl = end-file->chunks[chunk].first;
 		}
-		seekset();
 	    }
-	    
 	    uint64_t cr=file->chunks[chunk].second-file->chunks[chunk].first-cl;
 	    uint64_t r = std::min(size,cr);
-	    if(::write(fd,buf,r) != r) THROW_PE("write");
+	    extents.push_back(std::make_pair(file->chunks[chunk].first+cl, r));
 	    size -= r;
-	    buf += r;
+	    mapped += r;
+	    pos += r;
 	    if(r < cr) {cl += r; break;}
 	    chunk++;
 	    cl = 0;
-	    if(chunk == file->chunks.size()) {chunk=(uint64_t)-1; continue;}
-	    seekset();
+	    if(chunk == file->chunks.size()) chunk=(uint64_t)-1;
+	}
+	return mapped;
+    }
+
+    uint64_t Handle::read(uint8_t * buf, uint64_t size) {
+	//std::cout << ">>Read" << std::endl;
+	std::vector<std::pair<uint64_t,uint64_t> > extents;
+	uint64_t read=0;
+	bool compressed;
+	{
+	    //Only the mapping needs the lock, the data is moved without it and
+	    //the pin keeps the space from being reused meanwhile
+	    lock l(&this->fs->mutex);
+	    revalidate();
+	    compressed = (file->flags & flagCompressed) != 0;
+	    if(!compressed) {
+		readahead(size);
+		read = map(size, extents, false);
+		fs->touch(file, read, false);
+		rapos = pos;
+		fs->pin(extents);
+	    }
 	}
+	if(compressed) return readCompressed(buf, size);
+	std::vector<piece_t> pieces;
+	for(size_t i=0; i < extents.size(); buf += extents[i].second, ++i)
+	    pieces.push_back(piece_t(extents[i].first, buf, extents[i].second));
+	try {
+	    transfer(fs->fds, pieces, false);
+	} catch(...) {
+	    fs->unpin(extents);
+	    throw;
+	}
+	fs->unpin(extents);
+	//std::cout << "<<Read" << std::endl;
+	return read;
+    }
+    
+    void Handle::write(const uint8_t * buf, uint64_t size) {
+	if(readOnly || this->fs->readonly) THROW_ERRNOG(EROFS, "Readonly file or fs");
+	lock l(&this->fs->mutex);
+	//std::cout << ">>Write " << chunk << " "  << size << std::endl;
+	if(file->flags & flagCompressed) {
+	    writeCompressed(buf, size);
+	    fs->commit();
+	    return;
+	}
+	std::vector<std::pair<uint64_t,uint64_t> > extents;
+	map(size, extents, true);
+	fs->touch(file, size, true);
+	std::vector<piece_t> pieces;
+	for(size_t i=0; i < extents.size(); buf += extents[i].second, ++i)
+	    pieces.push_back(piece_t(extents[i].first, const_cast<uint8_t*>(buf), extents[i].second));
+	transfer(fs->fds, pieces, true);
+	fs->commit();
 	//std::cout << "<<Write " << chunk << " "  << size << std::endl;
     }
 
-    FS::FS() {
+    void Handle::copyFrom(int fd, uint64_t offset, uint64_t size) {
+	if(readOnly || this->fs->readonly) THROW_ERRNOG(EROFS, "Readonly file or fs");
+	if(file->flags & flagCompressed) {
+	    //The data has to pass through the compressor anyway
+	    std::vector<uint8_t> buf(std::min(size, bounceSize));
+	    while(size > 0) {
+		ssize_t r = pread(fd, &buf[0], std::min(size, (uint64_t)buf.size()), offset);
+		if(r == -1) THROW_ERRNO("pread");
+		if(r == 0) THROW_ERRNOG(EIO, "Unexpected end of file");
+		write(&buf[0], r);
+		offset += r;
+		size -= r;
+	    }
+	    return;
+	}
+	//Only the mapping needs the lock, the data is moved without it
+	std::vector<std::pair<uint64_t,uint64_t> > extents;
+	{
+	    lock l(&this->fs->mutex);
+	    map(size, extents, true);
+	    fs->touch(file, size, true);
+	    fs->pin(extents);
+	}
+	try {
+	    for(size_t i=0; i < extents.size(); ++i) {
+		copyRange(fd, offset, fs->fds[deviceOf(extents[i].first)], offsetOf(extents[i].first), extents[i].second);
+		offset += extents[i].second;
+	    }
+	} catch(...) {
+	    fs->unpin(extents);
+	    throw;
+	}
+	fs->unpin(extents);
+	//A device flush may have started while the data was moved
+	lock l(&this->fs->mutex);
+	fs->dirty = true;
+	fs->commit();
+    }
+
+    uint64_t Handle::copyTo(int fd, uint64_t offset, uint64_t size) {
+	if(file->flags & flagCompressed) {
+	    std::vector<uint8_t> buf(std::min(size, bounceSize));
+	    uint64_t copied=0;
+	    while(size > 0) {
+		uint64_t r = read(&buf[0], std::min(size, (uint64_t)buf.size()));
+		if(r == 0) break;
+		if(pwrite(fd, &buf[0], r, offset) != (ssize_t)r) THROW_ERRNO("pwrite");
+		offset += r;
+		size -= r;
+		copied += r;
+	    }
+	    return copied;
+	}
+	std::vector<std::pair<uint64_t,uint64_t> > extents;
+	uint64_t copied;
+	{
+	    lock l(&this->fs->mutex);
+	    revalidate();
+	    copied = map(size, extents, false);
+	    fs->touch(file, copied, false);
+	    fs->pin(extents);
+	}
+	try {
+	    for(size_t i=0; i < extents.size(); ++i) {
+		copyRange(fs->fds[deviceOf(extents[i].first)], offsetOf(extents[i].first), fd, offset, extents[i].second);
+		offset += extents[i].second;
+	    }
+	} catch(...) {
+	    fs->unpin(extents);
+	    throw;
+	}
+	fs->unpin(extents);
+	return copied;
+    }
+
+    //Map size bytes from offset, leaving the position alone. Whoever asks is
+    //going to read them, so they count towards the heat
+    void Handle::mapAt(uint64_t offset, uint64_t size, std::vector<std::pair<uint64_t,uint64_t> > & extents) {
+	revalidate();
+	uint64_t oc=chunk, ocl=cl, opos=pos;
+	try {
+	    locate(offset);
+	    map(size, extents, false);
+	} catch(...) {
+	    chunk=oc; cl=ocl; pos=opos;
+	    throw;
+	}
+	chunk=oc; cl=ocl; pos=opos;
+	uint64_t total=0;
+	for(size_t i=0; i < extents.size(); ++i)
+	    total += extents[i].second;
+	fs->touch(file, total, false);
+    }
+
+    std::vector<Extent> Handle::extents(uint64_t offset, uint64_t size) {
+	if(file->flags & flagCompressed) THROW_ERRNOG(EOPNOTSUPP, "Compressed files have no raw extents");
+	lock l(&this->fs->mutex);
+	std::vector<std::pair<uint64_t,uint64_t> > extents;
+	mapAt(offset, size, extents);
+	std::vector<Extent> res;
+	for(size_t i=0; i < extents.size(); ++i) {
+	    Extent e = {deviceOf(extents[i].first), offsetOf(extents[i].first), extents[i].second};
+	    res.push_back(e);
+	}
+	return res;
+    }
+
+    uint64_t Handle::sendTo(int fd, uint64_t offset, uint64_t size) {
+	uint64_t sent=0;
+	if(file->flags & flagCompressed) {
+	    //The data has to be decompressed, it is read through this handle and
+	    //the position put back afterwards
+	    uint64_t opos = pos;
+	    pos = std::min(offset, this->size());
+	    std::vector<uint8_t> buf(std::min(size, bounceSize));
+	    try {
+		bool full = false;
+		while(size > 0 && !full) {
+		    uint64_t r = readCompressed(&buf[0], std::min(size, (uint64_t)buf.size()));
+		    if(r == 0) break;
+		    uint64_t w = 0;
+		    while(w < r) {
+			ssize_t x = ::write(fd, &buf[w], r-w);
+			if(x == -1 && errno == EINTR) continue;
+			//As with sendfile, what went out counts, the rest is read again next time
+			if(x == -1 && errno == EAGAIN && sent + w > 0) {
+			    full = true;
+			    break;
+			}
+			if(x == -1) THROW_ERRNO("write");
+			w += x;
+		    }
+		    size -= w;
+		    sent += w;
+		}
+	    } catch(...) {
+		pos = opos;
+		throw;
+	    }
+	    pos = opos;
+	    return sent;
+	}
+	if(offset >= this->size()) return 0;
+	std::vector<std::pair<uint64_t,uint64_t> > e;
+	{
+	    lock l(&this->fs->mutex);
+	    mapAt(offset, size, e);
+	    fs->pin(e);
+	}
+	try {
+	    bool full = false;
+	    for(size_t i=0; i < e.size() && !full; ++i) {
+		off_t o = offsetOf(e[i].first);
+		uint64_t left = e[i].second;
+		while(left > 0) {
+		    ssize_t x = sendfile(fd, fs->fds[deviceOf(e[i].first)], &o, left);
+		    if(x == -1 && errno == EINTR) continue;
+		    //Report what went out before a non blocking socket filled up
+		    if(x == -1 && errno == EAGAIN && sent > 0) {
+			full = true;
+			break;
+		    }
+		    if(x == -1) THROW_ERRNO("sendfile");
+		    if(x == 0) THROW_ERRNOG(EIO, "Unexpected end of device");
+		    left -= x;
+		    sent += x;
+		}
+	    }
+	} catch(...) {
+	    fs->unpin(e);
+	    throw;
+	}
+	fs->unpin(e);
+	return sent;
+    }
+
+    uint64_t Handle::size() {
+	lock l(&this->fs->mutex);
+	fs->refresh();
+	return file->size();
+    }
+
+    void Handle::flush() {
+	if(readOnly || this->fs->readonly) return;
+	lock l(&this->fs->mutex);
+	if(file->flags & flagCompressed) flushTail();
+	fs->commit();
+	closeError();
+    }
+
+    void Handle::sync() {
+	lock l(&this->fs->mutex);
+	if(!readOnly && !fs->readonly && (file->flags & flagCompressed)) flushTail();
+	fs->groupSync();
+	closeError();
+    }
+
+    //Report what another handle could not store when closing. Called with the
+    //lock held
+    void Handle::closeError() {
+	if(file->error == 0) return;
+	int error = file->error;
+	file->error = 0;
+	THROW_ERRNOG(error, "Could not store the tail of '%s' on close", file->name().c_str());
+    }
+
+    //Decompress a block into the cache, header and data come in one read.
+    //Called with the lock held
+    void Handle::loadBlock(uint64_t block) {
+	Compressed * c = file->compressed;
+	uint64_t expected = std::min(blockSize, c->length - block*blockSize);
+	if(cacheBlock == block && cache.size() == expected) return;
+	cacheBlock = (uint64_t)-1;
+	uint64_t start = c->blocks[block];
+	std::vector<uint8_t> buf(fs->blockEnd(file, block) - start);
+	fs->storedIO(file, start, &buf[0], buf.size(), false);
+	decodeBlock(&buf[0], buf.size(), cache);
+	cacheBlock = block;
+    }
+
+    //Move a partially filled last block back into the tail, so it can be appended to
+    void Handle::loadTail() {
+	Compressed * c = file->compressed;
+	uint64_t n = c->blocks.size();
+	if(c->length > n*blockSize || c->length % blockSize == 0) return;
+	loadBlock(n-1);
+	c->tail.swap(cache);
+	cacheBlock = (uint64_t)-1;
+	fs->cut(file, c->blocks.back());
+	c->blocks.pop_back();
+	c->stored = c->blocks.size();
+    }
+
+    void Handle::flushTail() {
+	Compressed * c = file->compressed;
+	if(c->length <= c->blocks.size()*blockSize) return;
+	uint64_t size = c->tail.size();
+	std::vector<uint8_t> buf(sizeof(block_t) + size);
+	block_t * hdr = reinterpret_cast<block_t*>(&buf[0]);
+	uint64_t stored = lz::compress(&c->tail[0], size, &buf[sizeof(block_t)], size-1);
+	if(stored == 0) {
+	    memcpy(&buf[sizeof(block_t)], &c->tail[0], size);
+	    stored = size;
+	}
+	hdr->stored = stored;
+	hdr->size = size;
+	uint64_t offset = file->allocated();
+	//Recorded first, it only counts once the slot says the block is stored
+	fs->recordBlock(file, c->blocks.size(), offset);
+	try {
+	    allocate(sizeof(block_t) + stored);
+	} catch(...) {
+	    //Blocks follow each other, a partial allocation would leave a gap. The tail is kept
+	    fs->cut(file, offset);
+	    fs->writeFile(file);
+	    throw;
+	}
+	fs->storedIO(file, offset, &buf[0], sizeof(block_t) + stored, true);
+	c->blocks.push_back(offset);
+	c->stored = c->blocks.size();
+	c->tail.clear();
+	fs->writeFile(file);
+    }
+
+    //Copy what the cached block holds at the position, returns how much
+    uint64_t Handle::fromCache(uint8_t * buf, uint64_t size) {
+	uint64_t o = pos % blockSize;
+	if(o >= cache.size()) return 0;
+	uint64_t r = std::min(size, cache.size() - o);
+	memcpy(buf, &cache[o], r);
+	pos += r;
+	return r;
+    }
+
+    //The blocks a read needs are mapped and pinned under the lock, then read
+    //in one transfer and decompressed without it. The tail a writer still
+    //holds is copied under the lock
+    uint64_t Handle::readCompressed(uint8_t * buf, uint64_t size) {
+	uint64_t read=0;
+	while(size > 0) {
+	    uint64_t first, last;
+	    std::vector<uint64_t> bounds;  //Stored offsets of the blocks to read, then where the last ends
+	    std::vector<std::pair<uint64_t,uint64_t> > extents;
+	    {
+		lock l(&this->fs->mutex);
+		revalidate();
+		Compressed * c = file->compressed;
+		if(c == NULL || pos >= c->length) break;
+		first = last = pos / blockSize;
+		if(first >= c->blocks.size()) {
+		    //Other mounts see the tail once it is stored
+		    uint64_t o = pos % blockSize;
+		    if(o >= c->tail.size()) break;
+		    uint64_t r = std::min(size, c->tail.size() - o);
+		    memcpy(buf, &c->tail[o], r);
+		    fs->touch(file, r, false);
+		    buf += r;
+		    size -= r;
+		    read += r;
+		    pos += r;
+		    rapos = pos;
+		    continue;
+		}
+		if(cacheBlock != first || cache.size() != std::min(blockSize, c->length - first*blockSize)) {
+		    cacheBlock = (uint64_t)-1;
+		    last = std::min((pos + size - 1) / blockSize, (uint64_t)c->blocks.size() - 1);
+		    for(uint64_t b=first; b <= last; ++b)
+			bounds.push_back(c->blocks[b]);
+		    bounds.push_back(fs->blockEnd(file, last));
+		    fs->storedExtents(file, bounds.front(), bounds.back() - bounds.front(), extents);
+		    readaheadStored(bounds.back());
+		    fs->pin(extents);
+		}
+		fs->touch(file, std::min(pos + size, std::min(c->length, (last+1)*blockSize)) - pos, false);
+	    }
+	    if(!bounds.empty()) {
+		std::vector<uint8_t> data(bounds.back() - bounds.front());
+		std::vector<piece_t> pieces;
+		uint8_t * d = &data[0];
+		for(size_t i=0; i < extents.size(); d += extents[i].second, ++i)
+		    pieces.push_back(piece_t(extents[i].first, d, extents[i].second));
+		try {
+		    transfer(fs->fds, pieces, false);
+		} catch(...) {
+		    fs->unpin(extents);
+		    throw;
+		}
+		fs->unpin(extents);
+		for(uint64_t b=first; b <= last; ++b) {
+		    decodeBlock(&data[bounds[b-first] - bounds.front()], bounds[b-first+1] - bounds[b-first], cache);
+		    cacheBlock = b;
+		    if(b == last) break;
+		    uint64_t r = fromCache(buf, size);
+		    buf += r;
+		    size -= r;
+		    read += r;
+		}
+	    }
+	    uint64_t r = fromCache(buf, size);
+	    if(r == 0) break;
+	    buf += r;
+	    size -= r;
+	    read += r;
+	    rapos = pos;
+	}
+	return read;
+    }
+
+    //Readahead for compressed files, over the stored bytes following end,
+    //where what the current read fetches ends. Called with the lock held
+    void Handle::readaheadStored(uint64_t end) {
+	if(pos != rapos) {
+	    rawindow = 0;
+	    raend = end;
+	    return;
+	}
+	rawindow = rawindow == 0 ? minReadahead : std::min(rawindow*2, maxReadahead);
+	if(raend >= end + rawindow/2) return;
+	uint64_t from = std::max(raend, end);
+	uint64_t to = std::min(end + rawindow, file->allocated());
+	if(from >= to) return;
+	std::vector<std::pair<uint64_t,uint64_t> > extents;
+	fs->storedExtents(file, from, to - from, extents);
+	for(size_t i=0; i < extents.size(); ++i)
+	    posix_fadvise(fs->fds[deviceOf(extents[i].first)], offsetOf(extents[i].first), extents[i].second, POSIX_FADV_WILLNEED);
+	raend = to;
+    }
+
+    void Handle::writeCompressed(const uint8_t * buf, uint64_t size) {
+	Compressed * c = file->compressed;
+	fs->touch(file, size, true);
+	if(pos != c->length) THROW_ERRNOG(EOPNOTSUPP, "Compressed files can only be appended to");
+	loadTail();
+	while(size > 0) {
+	    uint64_t r = std::min(size, blockSize - c->tail.size());
+	    c->tail.insert(c->tail.end(), buf, buf+r);
+	    c->length += r;
+	    size -= r;
+	    buf += r;
+	    pos += r;
+	    if(c->tail.size() == blockSize) flushTail();
+	}
+    }
+
+    void Handle::truncateCompressed(uint64_t size) {
+	Compressed * c = file->compressed;
+	flushTail();
+	if(size >= c->length) {
+	    std::vector<uint8_t> zero(blockSize, 0);
+	    pos = c->length;
+	    while(pos < size) writeCompressed(&zero[0], std::min(blockSize, size-pos));
+	    flushTail();
+	} else {
+	    uint64_t block = size / blockSize;
+	    std::vector<uint8_t> keep;
+	    if(size % blockSize != 0) {
+		loadBlock(block);
+		keep.assign(cache.begin(), cache.begin() + size % blockSize);
+	    }
+	    fs->cut(file, c->blocks[block]);
+	    c->blocks.resize(block);
+	    c->stored = block;
+	    c->tail.swap(keep);
+	    c->length = size;
+	    //Readers drop the blocks they know of instead of extending them
+	    c->reset = fs->generation;
+	    cacheBlock = (uint64_t)-1;
+	}
+	fs->writeFile(file);
+	pos = 0;
+    }
+
+    FS::FS(): stripe(0), growStep(0), growLimit(0), running(false), stopping(false), discard(true),
+	      discarded(0), hotDevice(0), hotSize(0), cooled(0), durability(syncNone), dirty(false), syncing(false),
+	      syncRequested(0), syncDone(0), failure(0), inotifyfd(-1), stale(false), generation(0),
+	      readonly(true), writing(false), legacy(false), tableStart(sizeof(header_t)) {
+	root = new Dir(NULL, NULL);
 	pthread_mutex_init(&mutex,NULL);
+	pthread_cond_init(&cond,NULL);
+	pthread_cond_init(&synced,NULL);
     }
 
 
     FS::~FS() {
+	umount();
+	delete root;
+	pthread_cond_destroy(&synced);
+	pthread_cond_destroy(&cond);
 	pthread_mutex_destroy(&mutex);
     }
 
+    void FS::setDiscard(bool discard) {
+	lock l(&mutex);
+	this->discard = discard;
+	if(!discard) {
+	    discards.clear();
+	    discarded = 0;
+	}
+    }
+
+    void FS::setGrowth(uint64_t step, uint64_t limit) {
+	lock l(&mutex);
+	growStep = step;
+	growLimit = limit;
+    }
+
+    void FS::setHotRegion(uint64_t device, uint64_t size) {
+	lock l(&mutex);
+	if(size != 0 && device >= fds.size()) THROW_ERRNOG(EINVAL, "No such device");
+	hotDevice = device;
+	hotSize = size;
+    }
+
+    void FS::heat(const std::string & name, double & reads, double & writes) {
+	lock l(&mutex);
+	refresh();
+	File * file = find(name);
+	if(file == NULL) THROW_ERRNOG(ENOENT,"File not found");
+	reads = writes = 0;
+	std::map<File *, heat_t>::iterator i = heats.find(file);
+	if(i == heats.end()) return;
+	decay(i->second, seconds());
+	reads = i->second.reads;
+	writes = i->second.writes;
+    }
+
+    void FS::setDurability(Durability durability) {
+	lock l(&mutex);
+	this->durability = durability;
+	if(durability == syncPeriodic && dirty) startMaintenance();
+    }
+
+    void FS::sync() {
+	lock l(&mutex);
+	groupSync();
+    }
+
+    //Flush the devices for everything written before the call. Callers arriving
+    //while a flush runs wait for the next one, which covers all of them, so many
+    //concurrent callers cost one fdatasync per device. Called with the lock
+    //held, it is dropped while the devices flush.
+    void FS::groupSync() {
+	if(readonly || fds.empty()) return;
+	if(!dirty && !syncing) return;
+	uint64_t ticket = ++syncRequested;
+	while(syncDone < ticket) {
+	    if(syncing) {
+		pthread_cond_wait(&synced, &mutex);
+		continue;
+	    }
+	    syncing = true;
+	    dirty = false;
+	    uint64_t covers = syncRequested;
+	    std::vector<int> devices = fds;
+	    pthread_mutex_unlock(&mutex);
+	    int error = flushDevices(devices);
+	    pthread_mutex_lock(&mutex);
+	    syncing = false;
+	    pthread_cond_broadcast(&synced);
+	    if(error) {
+		dirty = true;
+		THROW_ERRNOG(error, "fdatasync");
+	    }
+	    syncDone = covers;
+	}
+    }
+
+    //Keep the first error there was nobody to throw to, for lastError. Called
+    //with the lock held
+    void FS::fail(const std::exception & e) {
+	if(failure != 0) return;
+	failure = errnoOf(e);
+	failureWhat = e.what();
+    }
+
+    int FS::lastError(std::string & what) {
+	lock l(&mutex);
+	int res = failure;
+	what.swap(failureWhat);
+	failure = 0;
+	failureWhat.clear();
+	return res;
+    }
+
+    //Called with the lock held once a change is complete
+    void FS::commit() {
+	if(durability == syncStrict) groupSync();
+    }
+
+    //Count an access to a file towards its heat
+    void FS::touch(File * file, uint64_t size, bool write) {
+	uint64_t now = seconds();
+	if(now >= cooled + maintenanceInterval) cool(now);
+	heat_t & h = heats[file];
+	decay(h, now);
+	if(write) {
+	    h.writes += size;
+	    h.modified++;
+	    dirty = true;
+	} else
+	    h.reads += size;
+	if(hotSize != 0 || (write && durability == syncPeriodic)) startMaintenance();
+    }
+
+    void FS::decay(heat_t & h, uint64_t now) {
+	if(now <= h.stamp) return;
+	double f = exp2(-(double)(now - h.stamp) / heatHalfLife);
+	h.reads *= f;
+	h.writes *= f;
+	h.stamp = now;
+    }
+
+    //Decay every heat and forget the files that have gone cold. Called with
+    //the lock held
+    void FS::cool(uint64_t now) {
+	cooled = now;
+	for(std::map<File *, heat_t>::iterator i=heats.begin(); i != heats.end(); ) {
+	    decay(i->second, now);
+	    if(i->second.reads + i->second.writes < 1)
+		heats.erase(i++);
+	    else
+		++i;
+	}
+    }
+
+    //Where hot files are packed, after the file table on device 0
+    void FS::hotRegion(uint64_t & start, uint64_t & end) {
+	uint64_t s = hotDevice == 0 ? tableStart + maxfiles*filesize : sizeof(header_t);
+	start = address(hotDevice, s);
+	end = address(hotDevice, std::max(s, std::min(s + hotSize, sizes[hotDevice])));
+    }
+
+    //Collect the slots of files with data in the hot region. The table is
+    //walked scanBatch slots at a time, so the lock is not held throughout.
+    void FS::scanRegion(std::vector<uint32_t> & inside) {
+	inside.clear();
+	for(uint32_t k=0; ; ) {
+	    lock l(&mutex);
+	    if(stopping || k >= slots.size()) return;
+	    uint64_t begin, end;
+	    hotRegion(begin, end);
+	    for(uint32_t n=0; n < scanBatch && k < slots.size(); ++n, ++k) {
+		File * file = slots[k];
+		if(file == NULL) continue;
+		for(size_t c=0; c < file->chunks.size(); ++c)
+		    if(file->chunks[c].first < end && file->chunks[c].second > begin) {
+			inside.push_back(k);
+			break;
+		    }
+	    }
+	}
+    }
+
+    //Choose the next file to move and where to. Hot files, those read over more
+    //often than hotThreshold, go to the lowest free space in the hot region, so
+    //they end up together. When they do not fit a cold file in the region goes
+    //to the highest free space outside it, taken from the slots scanRegion
+    //found. crowded is set when that list is needed. Called with the lock held.
+    File * FS::pickMove(uint64_t & start, std::vector<uint32_t> & inside, bool & crowded) {
+	uint64_t begin, end;
+	hotRegion(begin, end);
+	cool(seconds());
+	std::vector<std::pair<double, File *> > rank;
+	for(std::map<File *, heat_t>::iterator i=heats.begin(); i != heats.end(); ++i) {
+	    uint64_t size = i->first->allocated();
+	    double times = i->second.reads / std::max(size, blockSize);
+	    if(times >= hotThreshold && size > 0 && i->first->dir != NULL) rank.push_back(std::make_pair(times, i->first));
+	}
+	std::sort(rank.rbegin(), rank.rend());
+	//The hottest files that fit in the region
+	std::set<File *> hot;
+	uint64_t room = end - begin;
+	for(size_t i=0; i < rank.size(); ++i) {
+	    uint64_t size = rank[i].second->allocated();
+	    if(size > room) continue;
+	    room -= size;
+	    hot.insert(rank[i].second);
+	}
+	for(size_t i=0; i < rank.size(); ++i) {
+	    File * file = rank[i].second;
+	    if(!hot.count(file) || writers.count(file)) continue;
+	    if(file->chunks.size() == 1 && file->chunks[0].first >= begin && file->chunks[0].second <= end) continue;
+	    uint64_t size = file->allocated();
+	    freespace_t::iterator j = freespace.lower_bound(std::make_pair(begin, (uint64_t)0));
+	    if(j != freespace.begin()) --j;
+	    for(; j != freespace.end() && j->first < end; ++j) {
+		uint64_t a = std::max(j->first, begin);
+		if(std::min(j->second, end) >= a + size) {
+		    start = a;
+		    return file;
+		}
+	    }
+	    //Make room. Slots may have changed since the scan, so each is checked
+	    //again and dropped once looked at
+	    crowded = true;
+	    while(!inside.empty()) {
+		uint32_t k = inside.back();
+		inside.pop_back();
+		File * cold = k < slots.size() ? slots[k] : NULL;
+		if(cold == NULL || hot.count(cold) || writers.count(cold) || cold->chunks.empty()) continue;
+		bool in = false;
+		for(size_t c=0; c < cold->chunks.size() && !in; ++c)
+		    in = cold->chunks[c].first < end && cold->chunks[c].second > begin;
+		if(!in) continue;
+		uint64_t csize = cold->allocated();
+		for(freespace_t::reverse_iterator j=freespace.rbegin(); j != freespace.rend(); ++j) {
+		    uint64_t a = j->first < end && j->second > begin ? std::max(j->first, end) : j->first;
+		    if(a < j->second && j->second - a >= csize) {
+			start = j->second - csize;
+			return cold;
+		    }
+		}
+		return NULL;
+	    }
+	    return NULL;
+	}
+	return NULL;
+    }
+
+    //Move files in or out of the hot region, up to relocateBatch bytes a pass.
+    //The data is copied without the lock and the move is dropped if the file
+    //was written meanwhile. Read only mounts of the same devices may have
+    //mapped the old place before they saw the move, so the space moved away
+    //from is only released retireGrace seconds later.
+    void FS::relocate() {
+	{
+	    lock l(&mutex);
+	    uint64_t now = seconds();
+	    if(!retired.empty() && retired.begin()->first <= now) {
+		while(!retired.empty() && retired.begin()->first <= now) {
+		    release(retired.begin()->second.first, retired.begin()->second.second);
+		    retired.erase(retired.begin());
+		}
+		compressFreeSpace();
+	    }
+	}
+	std::vector<uint32_t> inside;
+	bool scanned = false, rescan = false;
+	for(uint64_t moved=0; moved < relocateBatch; ) {
+	    if(rescan) {
+		rescan = false;
+		scanned = true;
+		scanRegion(inside);
+	    }
+	    File * file;
+	    uint64_t start, size, modified;
+	    std::vector<std::pair<uint64_t,uint64_t> > from;
+	    {
+		lock l(&mutex);
+		if(stopping || hotSize == 0 || readonly) return;
+		bool crowded = false;
+		file = pickMove(start, inside, crowded);
+		if(file == NULL && crowded && !scanned) {
+		    //Look for cold files in the region once a pass, then try again
+		    rescan = true;
+		    continue;
+		}
+		if(file == NULL) return;
+		size = file->allocated();
+		for(size_t c=0; c < file->chunks.size(); ++c)
+		    from.push_back(file->chunks[c]);
+		modified = heats[file].modified;
+		freespace_t::iterator i = --freespace.upper_bound(std::make_pair(start, (uint64_t)-1));
+		std::pair<uint64_t,uint64_t> e = *i;
+		freespace.erase(i);
+		if(e.first != start) freespace.insert(std::make_pair(e.first, start));
+		if(start+size != e.second) freespace.insert(std::make_pair(start+size, e.second));
+		file->usage++;
+	    }
+	    bool copied = true;
+	    try {
+		uint64_t to = start;
+		for(size_t c=0; c < from.size(); ++c) {
+		    uint64_t s = from[c].second - from[c].first;
+		    copyRange(fds[deviceOf(from[c].first)], offsetOf(from[c].first), fds[deviceOf(to)], offsetOf(to), s);
+		    to += s;
+		}
+	    } catch(const std::exception & e) {
+		lock l(&mutex);
+		fail(e);
+		copied = false;
+	    }
+	    lock l(&mutex);
+	    if(copied && file->dir != NULL && !writers.count(file) && heats[file].modified == modified && file->chunks == from) {
+		file->chunks.assign(std::vector<std::pair<uint64_t,uint64_t> >(1, std::make_pair(start, start+size)));
+		file->layout++;
+		writeFile(file);
+		for(size_t c=0; c < from.size(); ++c)
+		    retired.insert(std::make_pair(seconds() + retireGrace, from[c]));
+	    } else
+		release(start, start+size);
+	    unuse(file);
+	    moved += size;
+	}
+    }
+
+    //The maintenance thread is started on first use rather than at mount, so
+    //it survives a daemon forking after mounting (as fuse_main does)
+    void FS::startMaintenance() {
+	if(running || readonly) return;
+	stopping = false;
+	running = pthread_create(&thread, NULL, maintenance, this) == 0;
+    }
+
+    void * FS::maintenance(void * arg) {
+	FS * fs = reinterpret_cast<FS*>(arg);
+	while(true) {
+	    bool flush;
+	    {
+		lock l(&fs->mutex);
+		timespec t;
+		clock_gettime(CLOCK_REALTIME, &t);
+		t.tv_sec += maintenanceInterval;
+		while(!fs->stopping && fs->discarded < discardBatch)
+		    if(pthread_cond_timedwait(&fs->cond, &fs->mutex, &t) == ETIMEDOUT) break;
+		if(fs->stopping) break;
+		flush = fs->durability == syncPeriodic;
+	    }
+	    fs->punch();
+	    try {
+		fs->relocate();
+		if(flush) fs->sync();
+	    } catch(const std::exception & e) {
+		lock l(&fs->mutex);
+		fs->fail(e);
+	    }
+	}
+	return NULL;
+    }
+
+    //Return space to the free space map. Pieces that transfers running without
+    //the lock still use are held back until they are unpinned
+    void FS::release(uint64_t start, uint64_t end) {
+	if(start == end) return;
+	uint64_t at = start;
+	for(std::multiset<std::pair<uint64_t,uint64_t> >::iterator i=pinned.begin(); i != pinned.end() && i->first < end; ++i) {
+	    uint64_t a = std::max(i->first, at);
+	    uint64_t b = std::min(i->second, end);
+	    if(a >= b) continue;
+	    if(at < a) reclaim(at, a);
+	    held.insert(std::make_pair(a, b));
+	    at = b;
+	}
+	if(at < end) reclaim(at, end);
+    }
+
+    //Put space into the free space map, it is punched out of the devices later
+    void FS::reclaim(uint64_t start, uint64_t end) {
+	freespace.insert( std::make_pair(start, end) );
+	if(!discard || readonly) return;
+	discards.insert( std::make_pair(start, end) );
+	discarded += end - start;
+	startMaintenance();
+	if(discarded >= discardBatch) pthread_cond_signal(&cond);
+    }
+
+    //Keep mapped extents from being reused until unpin, for a transfer that
+    //runs without the lock. Called with the lock held
+    void FS::pin(const std::vector<std::pair<uint64_t,uint64_t> > & extents) {
+	//The extents are address and length, pinned ranges start and end
+	for(size_t i=0; i < extents.size(); ++i)
+	    pinned.insert(std::make_pair(extents[i].first, extents[i].first + extents[i].second));
+    }
+
+    void FS::unpin(const std::vector<std::pair<uint64_t,uint64_t> > & extents) {
+	lock l(&mutex);
+	for(size_t i=0; i < extents.size(); ++i) {
+	    //umount drops the pins of transfers it outlives
+	    std::multiset<std::pair<uint64_t,uint64_t> >::iterator p = pinned.find(std::make_pair(extents[i].first, extents[i].first + extents[i].second));
+	    if(p != pinned.end()) pinned.erase(p);
+	}
+	if(held.empty()) return;
+	freespace_t h;
+	h.swap(held);
+	for(freespace_t::iterator i=h.begin(); i != h.end(); ++i)
+	    release(i->first, i->second);
+	compressFreeSpace();
+    }
+
+    //Punch holes for the released space, taking the lock for one range at a time
+    void FS::punch() {
+	while(true) {
+	    //Still free pieces are taken out of the free space while they are
+	    //punched without the lock, so they are not handed out meanwhile
+	    std::vector<std::pair<uint64_t, uint64_t> > pieces;
+	    {
+		lock l(&mutex);
+		if(discards.empty() || !discard) {
+		    discarded = 0;
+		    return;
+		}
+		std::pair<uint64_t, uint64_t> r = *discards.begin();
+		discards.erase(discards.begin());
+		discarded -= std::min(discarded, r.second - r.first);
+		//Only what is still free, it may have been allocated again meanwhile
+		freespace_t::iterator i = freespace.upper_bound( std::make_pair(r.first, (uint64_t)-1) );
+		if(i != freespace.begin()) --i;
+		for(; i != freespace.end() && i->first < r.second; ++i) {
+		    uint64_t a = std::max(i->first, r.first);
+		    uint64_t b = std::min(i->second, r.second);
+		    if(a < b) pieces.push_back(std::make_pair(a, b));
+		}
+		for(size_t p=0; p < pieces.size(); ++p)
+		    claim(--freespace.upper_bound(std::make_pair(pieces[p].first, (uint64_t)-1)), pieces[p].first, pieces[p].second - pieces[p].first);
+	    }
+	    bool unsupported = false;
+	    for(size_t p=0; p < pieces.size() && !unsupported; ++p)
+		unsupported = fallocate(fds[deviceOf(pieces[p].first)], FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+					offsetOf(pieces[p].first), pieces[p].second - pieces[p].first) == -1 &&
+		    (errno == EOPNOTSUPP || errno == ENOSYS);
+	    lock l(&mutex);
+	    for(size_t p=0; p < pieces.size(); ++p)
+		freespace.insert(pieces[p]);
+	    if(!pieces.empty()) compressFreeSpace();
+	    //The device cannot do it, stop trying
+	    if(unsupported) discard = false;
+	}
+    }
+
+    //Extend a device that is a regular file by at least size bytes, in steps of growStep
+    bool FS::grow(uint64_t size) {
+	if(growStep == 0) return false;
+	uint64_t d = fds.size();
+	for(uint64_t i=0; i < fds.size(); ++i)
+	    if(growable[i] && (d == fds.size() || sizes[i] < sizes[d])) d = i;
+	if(d == fds.size()) return false;
+	uint64_t n = (size + growStep - 1) / growStep * growStep;
+	//Addresses have no room for offsets beyond deviceShift bits
+	uint64_t limit = growLimit != 0 ? std::min(growLimit, (uint64_t)1 << deviceShift) : (uint64_t)1 << deviceShift;
+	if(sizes[d] + n > limit) {
+	    if(sizes[d] >= limit) return false;
+	    n = limit - sizes[d];
+	}
+	if(ftruncate(fds[d], sizes[d] + n) == -1) return false;
+	freespace.insert( std::make_pair(address(d, sizes[d]), address(d, sizes[d] + n)) );
+	sizes[d] += n;
+	compressFreeSpace();
+	return true;
+    }
+
+    int FS::deviceFd(uint64_t device) {
+	if(device >= fds.size()) THROW_ERRNOG(EINVAL, "No such device");
+	return fds[device];
+    }
+
+    void FS::umount() {
+	if(running) {
+	    {
+		lock l(&mutex);
+		stopping = true;
+		pthread_cond_signal(&cond);
+	    }
+	    pthread_join(thread, NULL);
+	    running = false;
+	}
+	pinned.clear();
+	for(std::multimap<uint64_t, std::pair<uint64_t,uint64_t> >::iterator i=retired.begin(); i != retired.end(); ++i)
+	    release(i->second.first, i->second.second);
+	retired.clear();
+	for(freespace_t::iterator i=held.begin(); i != held.end(); ++i)
+	    reclaim(i->first, i->second);
+	held.clear();
+	punch();
+	if(durability != syncNone) {
+	    try {
+		sync();
+	    } catch(const std::exception & e) {
+		lock l(&mutex);
+		fail(e);
+	    }
+	}
+	for(size_t d=0; d < fds.size(); ++d)
+	    ::close(fds[d]);
+	fds.clear();
+	if(inotifyfd != -1) ::close(inotifyfd);
+	inotifyfd = -1;
+    }
+
     uint64_t FS::size(const std::string & name) {
-	lock l(&mutex, !this->readonly);
-	files_t::iterator i = files.find(name);
-	if(i == files.end()) THROW_ERRNOG(ENOENT,"File not found");
-	return i->second->size();
+	lock l(&mutex);
+	refresh();
+	File * file = find(name);
+	if(file == NULL) THROW_ERRNOG(ENOENT,"File not found");
+	return file->size();
+    }
+
+    bool FS::lookup(const std::string & name, bool & directory, uint64_t & size) {
+	lock l(&mutex);
+	refresh();
+	File * file = find(name);
+	directory = file == NULL;
+	size = file == NULL ? 0 : file->size();
+	return file != NULL || walk(name, false) != NULL;
+    }
+
+    std::vector<std::string> FS::list(const std::string & directory) {
+	lock l(&mutex);
+	refresh();
+	Dir * dir = walk(directory, false);
+	if(dir == NULL) THROW_ERRNOG(ENOENT,"Directory not found");
+	//A name can be both a file and a directory, it is listed once
+	std::set<std::string> res;
+	for(std::map<std::string, Dir *>::iterator i=dir->dirs.begin(); i != dir->dirs.end(); ++i)
+	    if(!i->first.empty()) res.insert(i->first);
+	for(std::map<const char *, File *, Dir::less>::iterator i=dir->files.begin(); i != dir->files.end(); ++i)
+	    if(*i->first) res.insert(i->first);
+	return std::vector<std::string>(res.begin(), res.end());
+    }
+
+    std::vector<std::string> FS::names(const std::string & path) {
+	lock l(&mutex);
+	refresh();
+	std::vector<std::string> res;
+	if(!path.empty() && find(path) != NULL) res.push_back(path);
+	Dir * dir = walk(path, false);
+	if(dir != NULL) collect(dir, res);
+	return res;
+    }
+
+    void FS::collect(Dir * dir, std::vector<std::string> & names) {
+	for(std::map<const char *, File *, Dir::less>::iterator i=dir->files.begin(); i != dir->files.end(); ++i)
+	    names.push_back(i->second->name());
+	for(std::map<std::string, Dir *>::iterator i=dir->dirs.begin(); i != dir->dirs.end(); ++i)
+	    collect(i->second, names);
+    }
+
+    Dir::~Dir() {
+	for(std::map<std::string, Dir *>::iterator i=dirs.begin(); i != dirs.end(); ++i)
+	    delete i->second;
+    }
+
+    //The directory holding the names that start with path/, the top for ""
+    Dir * FS::walk(const std::string & path, bool create) {
+	Dir * dir = root;
+	if(path.empty()) return dir;
+	for(size_t b=0;;) {
+	    size_t e = path.find('/', b);
+	    std::string c = path.substr(b, e == std::string::npos ? std::string::npos : e-b);
+	    std::map<std::string, Dir *>::iterator i = dir->dirs.find(c);
+	    if(i == dir->dirs.end()) {
+		if(!create) return NULL;
+		i = dir->dirs.insert( std::make_pair(c, (Dir *)NULL) ).first;
+		i->second = new Dir(dir, &i->first);
+	    }
+	    dir = i->second;
+	    if(e == std::string::npos) return dir;
+	    b = e+1;
+	}
+    }
+
+    File * FS::find(const std::string & name) {
+	size_t i = name.rfind('/');
+	Dir * dir = walk(i == std::string::npos ? std::string() : name.substr(0, i), false);
+	if(dir == NULL) return NULL;
+	std::map<const char *, File *, Dir::less>::iterator f = dir->files.find(name.c_str() + (i == std::string::npos ? 0 : i+1));
+	return f == dir->files.end() ? NULL : f->second;
+    }
+
+    //Put a file into the tree, name ends with its leaf
+    void FS::insert(File * file, const std::string & name) {
+	size_t i = name.rfind('/');
+	Dir * dir = walk(i == std::string::npos ? std::string() : name.substr(0, i), true);
+	dir->files[file->leaf] = file;
+	file->dir = dir;
+    }
+
+    //Take a file out of the tree, along with the directories left empty
+    void FS::remove(File * file) {
+	Dir * dir = file->dir;
+	if(dir == NULL) return;
+	dir->files.erase(file->leaf);
+	file->dir = NULL;
+	while(dir->parent != NULL && dir->files.empty() && dir->dirs.empty()) {
+	    Dir * parent = dir->parent;
+	    parent->dirs.erase(*dir->name);
+	    delete dir;
+	    dir = parent;
+	}
     }
     
 
-    Handle * FS::open(const std::string & name, bool readOnly, Handle * h) {
+    Handle * FS::open(const std::string & name, bool readOnly, Handle * h, bool compress) {
 	//std::cout << ">> Open" << std::endl;
 	std::auto_ptr<Handle> nh;
 	if(h == NULL) {
 	    nh = std::auto_ptr<Handle>(new Handle());
 	    h = nh.get();
 	}
-	lock l(&mutex, !this->readonly);
-	files_t::iterator i = files.find(name);
-	File * file;
+	lock l(&mutex);
+	refresh();
+	File * file = find(name);
+	bool created = file == NULL;
 	
-	fdw fd = getFd();
-	if(i == files.end()) {
+	if(file == NULL) {
 	    if(readOnly || this->readonly) THROW_ERRNOG(EROFS, "Readonly file or fs");
-	    if(files.size() == maxfiles) THROW_ERRNOG(ENOSPC, "No more free file slots");
-	    file = new File();
-	    file->usage = 1;
-	    file->index = files.size();
-	    file->name = name;
-	    writeFile(fd, file);
-	    files[name] = file;
-	    filelist.insert(name);
-	    writeHeader(fd);
-	} else 
-	    file = i->second;
+	    if(slots.size() == maxfiles) THROW_ERRNOG(ENOSPC, "No more free file slots");
+	    if(name.size() >= sizeof(((file_t*)0)->name)) THROW_ERRNOG(ENAMETOOLONG, "File name too long");
+	    file = File::create(&arena, name);
+	    file->index = slots.size();
+	    if(compress) {
+		if(legacy) THROW_ERRNOG(EOPNOTSUPP, "Compression needs a version %d filesystem", (int)version);
+		file->flags = flagCompressed;
+		file->compressed = new Compressed();
+		file->compressed->reset = generation;
+	    }
+	    insert(file, name);
+	    slots.push_back(file);
+	    writeFile(file);
+	    //For the count of files, writeFile has written it already otherwise
+	    if(legacy) writeHeader();
+	}
+	if(!readOnly && !this->readonly) writers[file]++;
+	if(file->compressed && file->compressed->blocks.size() < file->compressed->stored)
+	    loadBlocks(file);
 	file->usage++;
 	h->fs = this;
-	h->fd = fd;
 	h->file = file;
 	h->readOnly = readOnly;
 	h->chunk = (uint64_t)-1;
 	h->cl = 0;
-	if(file->chunks.size() > 0) {
-	    if(lseek(fd,file->chunks[0].first,SEEK_SET) == -1) THROW_PE("lseek");
-	    h->chunk = 0;
-	}
-	fd.release();
+	h->pos = 0;
+	h->rapos = (uint64_t)-1;
+	h->raend = 0;
+	h->rawindow = 0;
+	h->cacheBlock = (uint64_t)-1;
+	h->layout = file->layout;
+	if(file->chunks.size() > 0) h->chunk = 0;
+	if(created) commit();
 	nh.release();
 	//std::cout << "<< Open" << std::endl;
 	return h;
     }
 
-    int FS::getFd() {
-	int fd = ::open(path.c_str(),O_NOATIME | O_RDWR);
-	if(fd == -1) THROW_ERRNO("Unable to open file '%s'",path.c_str());
-	return fd;
+    //Pick up the file slots a writer changed since the last refresh of a read
+    //only mount. The writer flags the header while it writes and bumps the
+    //generation after each slot, so a table read between two equal, unflagged
+    //headers is consistent. A version 1 header has no generation to go by.
+    //Called with the lock held.
+    void FS::refresh() {
+	if(!readonly || fds.empty() || legacy) return;
+	if(inotifyfd != -1) {
+	    //Without inotify the header is checked every time
+	    char events[4096];
+	    while(::read(inotifyfd, events, sizeof(events)) > 0) stale = true;
+	    if(!stale) return;
+	}
+	uint8_t buf[filesize];
+	file_t * f = reinterpret_cast<file_t*>(buf);
+	for(int attempt=0; attempt < refreshAttempts; ++attempt) {
+	    header_t before, after;
+	    if(pread(fds[0], &before, sizeof(header_t), 0) != sizeof(header_t)) THROW_PE("pread");
+	    //The writer is busy, it writes the header again when done
+	    if(before.writing) return;
+	    if(before.generation == generation && before.files == slots.size()) {
+		stale = false;
+		return;
+	    }
+	    std::set<uint64_t> changed;
+	    if(before.generation < generation || before.generation - generation > ringSize) {
+		//Too much changed, read the whole table
+		for(uint64_t i=0; i < std::max(before.files, (uint64_t)slots.size()); ++i) changed.insert(i);
+	    } else {
+		for(uint64_t g=generation+1; g <= before.generation; ++g) changed.insert(before.changes[g % ringSize]);
+		for(uint64_t i=std::min(before.files, (uint64_t)slots.size()); i < std::max(before.files, (uint64_t)slots.size()); ++i)
+		    changed.insert(i);
+	    }
+	    std::vector<std::pair<uint64_t, std::vector<uint8_t> > > table;
+	    for(std::set<uint64_t>::iterator i=changed.begin(); i != changed.end() && *i < before.files; ++i) {
+		if(pread(fds[0], buf, filesize, sizeof(header_t) + *i*filesize) != filesize) THROW_PE("pread");
+		table.push_back(std::make_pair(*i, std::vector<uint8_t>(buf, buf+filesize)));
+	    }
+	    if(pread(fds[0], &after, sizeof(header_t), 0) != sizeof(header_t)) THROW_PE("pread");
+	    if(after.writing || after.generation != before.generation || after.files != before.files) continue;
+
+	    //Take the files out of the changed slots, those found again are put back
+	    std::map<std::string, File *> detached;
+	    for(std::set<uint64_t>::iterator i=changed.begin(); i != changed.end(); ++i) {
+		if(*i >= slots.size() || slots[*i] == NULL) continue;
+		File * file = slots[*i];
+		slots[*i] = NULL;
+		detached[file->name()] = file;
+		remove(file);
+	    }
+	    slots.resize(before.files, NULL);
+	    for(size_t t=0; t < table.size(); ++t) {
+		memcpy(buf, &table[t].second[0], filesize);
+		f->name[sizeof(f->name)-1] = 0;
+		std::string name = f->name;
+		File * file;
+		std::map<std::string, File *>::iterator d = detached.find(name);
+		if(d != detached.end()) {
+		    file = d->second;
+		    detached.erase(d);
+		} else if((file = find(name)) != NULL) {
+		    if(slots[file->index] == file) slots[file->index] = NULL;
+		    remove(file);
+		} else
+		    file = File::create(&arena, name);
+		std::vector<std::pair<uint64_t,uint64_t> > chunks;
+		for(size_t j=0; j < f->chunkCount && j < maxchunks; ++j)
+		    chunks.push_back( std::make_pair( f->chunks[j].start, f->chunks[j].end) );
+		if(!(file->chunks == chunks) || f->flags != file->flags ||
+		   (file->compressed && (file->compressed->length != f->size || file->compressed->stored != f->blocks))) {
+		    //Open handles notice the stamp and find their position again
+		    file->chunks.assign(chunks);
+		    //Appending keeps the stored blocks, loadBlocks goes on from the last one
+		    if(file->compressed == NULL || f->flags != file->flags || file->compressed->reset != f->reset) {
+			delete file->compressed;
+			file->compressed = NULL;
+			if(f->flags & flagCompressed) file->compressed = new Compressed();
+		    }
+		    file->layout++;
+		}
+		file->index = table[t].first;
+		file->flags = f->flags;
+		if(file->compressed) {
+		    Compressed * c = file->compressed;
+		    c->length = f->size;
+		    c->reset = f->reset;
+		    c->stored = f->blocks;
+		    c->map = std::make_pair(f->map.start, f->map.end);
+		    //The writer took back a partial last block to append to it
+		    if(c->blocks.size() > c->stored) c->blocks.resize(c->stored);
+		}
+		insert(file, name);
+		slots[file->index] = file;
+	    }
+	    //What was not found again has been unlinked, read only mounts do not track free space
+	    for(std::map<std::string, File *>::iterator d=detached.begin(); d != detached.end(); ++d)
+		if(--d->second->usage == 0) {
+		    heats.erase(d->second);
+		    delete d->second;
+		}
+	    generation = before.generation;
+	    stale = false;
+	    return;
+	}
     }
 
-    void FS::writeFile(int fd, File * file) {
-	uint8_t buf[filesize];
-	memset(buf,0,filesize);
+    //Choose where a new chunk of a file goes, on the given device or anywhere
+    //for (uint64_t)-1. Every file being written claims the free space right
+    //after its last chunk. Other streams only start in the middle of such
+    //space, so concurrent writers each get a contiguous region. A new file is
+    //placed close to where its directory was last written, a growing file
+    //close to its own data, as long as that space is not claimed. Otherwise
+    //the largest unclaimed extent or half of a claimed one is used. With
+    //whole set only extents that hold all of size count as close.
+    freespace_t::iterator FS::place(File * file, uint64_t device, uint64_t size, uint64_t & start, bool whole) {
+	std::set<uint64_t> claimed;
+	for(std::map<File *, uint64_t>::iterator i=writers.begin(); i != writers.end(); ++i)
+	    if(i->first != file && !i->first->chunks.empty()) claimed.insert(i->first->chunks.back().second);
+
+	uint64_t hint = (uint64_t)-1;
+	if(!file->chunks.empty()) hint = file->chunks.back().second;
+	else if(file->dir != NULL) hint = file->dir->hint;
+	uint64_t enough = whole ? size : std::min(size, regionSize);
+	//New data stays out of the hot region while there is room elsewhere
+	uint64_t hotBegin=0, hotEnd=0;
+	if(hotSize != 0) hotRegion(hotBegin, hotEnd);
+
+	freespace_t::iterator best=freespace.end(), near=freespace.end();
+	uint64_t bestStart=0, nearStart=0, nearDistance=(uint64_t)-1;
+	for(freespace_t::iterator i=freespace.begin(); i != freespace.end(); ++i) {
+	    if(device != (uint64_t)-1 && deviceOf(i->first) != device) continue;
+	    uint64_t s = i->first;
+	    //Another writer is heading into this space, split it on a block boundary
+	    bool split = claimed.count(s) != 0;
+	    if(split) s = (s + (i->second - s) / 2) / blockSize * blockSize;
+	    if(s < hotEnd && i->second > hotBegin) s = std::max(s, hotEnd);
+	    if(s >= i->second || (split && s == i->first)) continue;
+	    if(best == freespace.end() || i->second - s > best->second - bestStart) {
+		best = i;
+		bestStart = s;
+	    }
+	    if(split || hint == (uint64_t)-1 || deviceOf(s) != deviceOf(hint) || i->second - s < enough) continue;
+	    uint64_t distance = s > hint ? s - hint : hint - s;
+	    if(distance < nearDistance) {
+		near = i;
+		nearStart = s;
+		nearDistance = distance;
+	    }
+	}
+	if(near != freespace.end()) {
+	    start = nearStart;
+	    return near;
+	}
+	if(best == freespace.end() && hotEnd != 0) {
+	    //Only the hot region is left
+	    uint64_t hs = hotSize;
+	    hotSize = 0;
+	    best = place(file, device, size, bestStart, whole);
+	    hotSize = hs;
+	}
+	start = bestStart;
+	return best;
+    }
+
+    //Remove up to size bytes from start inside a free extent from the free space, returns how much
+    uint64_t FS::claim(freespace_t::iterator i, uint64_t start, uint64_t size) {
+	uint64_t begin=i->first;
+	uint64_t end=i->second;
+	freespace.erase(i);
+	uint64_t s = std::min(end-start,size);
+	if(begin != start) freespace.insert(std::make_pair(begin,start));
+	if(start+s != end) freespace.insert(std::make_pair(start+s,end));
+	return s;
+    }
+
+    //Append up to size bytes from start inside a free extent to a file, returns how much was taken
+    uint64_t FS::take(File * file, freespace_t::iterator i, uint64_t start, uint64_t size) {
+	uint64_t s = claim(i, start, size);
+	if(!file->chunks.empty() && file->chunks.back().second == start)
+	    file->chunks.back().second += s;
+	else
+	    file->chunks.push_back(std::make_pair(start, start+s) );
+	if(file->dir != NULL) file->dir->hint = start+s;
+	return s;
+    }
+
+    //Grow the last chunk of a file into the free space right after it, returns how much
+    uint64_t FS::extend(File * file, uint64_t size) {
+	uint64_t p = file->chunks.back().second;
+	freespace_t::iterator i = freespace.lower_bound( std::make_pair(p,p) );
+	if(i == freespace.end() || i->first != p) return 0;
+	uint64_t s = claim(i, p, size);
+	file->chunks.back().second += s;
+	return s;
+    }
+
+    void FS::unwrite(File * file) {
+	std::map<File *, uint64_t>::iterator i = writers.find(file);
+	if(i != writers.end() && --i->second == 0) writers.erase(i);
+    }
+
+    //Flag the header while the slot is written, so read only mounts do not
+    //pick up a half written slot, then record it as changed. Inside a larger
+    //change, one that set writing already, the header is left to its end.
+    //Version 1 headers have no changes to record. An unlinked file has no
+    //slot any more, handles still open on it write nothing
+    void FS::writeFile(File * file) {
+	if(file->dir == NULL) return;
+	uint8_t buf[sizeof(file_t) + sizeof(chunk_t) * maxchunks];
+	memset(buf,0,sizeof(buf));
 	file_t * f = reinterpret_cast<file_t*>(buf);
-	strcpy(f->name,file->name.c_str());
+	strncpy(f->name,file->name().c_str(),sizeof(f->name)-1);
+	f->flags = file->flags;
+	f->size = file->compressed ? file->compressed->length : 0;
+	if(file->compressed) {
+	    f->reset = file->compressed->reset;
+	    f->blocks = file->compressed->stored;
+	    f->map.start = file->compressed->map.first;
+	    f->map.end = file->compressed->map.second;
+	}
 	f->chunkCount = file->chunks.size();
 	for(size_t i=0; i < file->chunks.size(); ++i) {
 	    f->chunks[i].start = file->chunks[i].first;
 	    f->chunks[i].end = file->chunks[i].second;
 	}
-	if(lseek(fd,sizeof(header_t) + filesize*file->index, SEEK_SET) == -1) THROW_PE("lseek");
-	if(write(fd,buf,filesize) != filesize) THROW_PE("write");
+	if(legacy) {
+	    narrow(buf, maxchunks);
+	    if(pwrite(fds[0],buf,filesize,tableStart + filesize*file->index) != filesize) THROW_PE("pwrite");
+	    dirty = true;
+	    return;
+	}
+	bool nested = writing;
+	if(!nested) {
+	    writing = true;
+	    writeHeader();
+	}
+	if(pwrite(fds[0],buf,filesize,tableStart + filesize*file->index) != filesize) THROW_PE("pwrite");
+	++generation;
+	changes[generation % ringSize] = file->index;
+	if(nested) return;
+	writing = false;
+	writeHeader();
     }
     
+    //The device extents, address and length, holding a range of the bytes
+    //stored for a file
+    void FS::storedExtents(File * file, uint64_t offset, uint64_t size, std::vector<std::pair<uint64_t,uint64_t> > & extents) {
+	for(size_t c=0; c < file->chunks.size() && size > 0; ++c) {
+	    uint64_t s = file->chunks[c].second - file->chunks[c].first;
+	    if(offset >= s) {offset -= s; continue;}
+	    uint64_t r = std::min(size, s-offset);
+	    extents.push_back(std::make_pair(file->chunks[c].first+offset, r));
+	    size -= r;
+	    offset = 0;
+	}
+	if(size != 0) THROW_E("Access beyond the stored data");
+    }
+
+    //Read or write a range of the bytes stored for a file, ignoring chunk boundaries
+    void FS::storedIO(File * file, uint64_t offset, uint8_t * buf, uint64_t size, bool write) {
+	std::vector<std::pair<uint64_t,uint64_t> > extents;
+	storedExtents(file, offset, size, extents);
+	std::vector<piece_t> pieces;
+	for(size_t i=0; i < extents.size(); buf += extents[i].second, ++i)
+	    pieces.push_back(piece_t(extents[i].first, buf, extents[i].second));
+	transfer(fds, pieces, write);
+    }
+
+    //Where block b of a compressed file ends in the stored bytes, at most
+    uint64_t FS::blockEnd(File * file, uint64_t b) {
+	Compressed * c = file->compressed;
+	if(b + 1 < c->blocks.size()) return c->blocks[b+1];
+	return std::min(file->allocated(), c->blocks[b] + sizeof(block_t) + blockSize);
+    }
+
+    //Read the offsets of the stored blocks after those already known from
+    //the block map, in one go
+    void FS::loadBlocks(File * file) {
+	Compressed * c = file->compressed;
+	uint64_t n = c->blocks.size();
+	if(n >= c->stored) return;
+	uint64_t at = c->map.first + n*sizeof(uint64_t);
+	uint64_t size = (c->stored - n)*sizeof(uint64_t);
+	if(at + size > c->map.second) THROW_E("Corrupt block map");
+	std::vector<uint64_t> offsets(c->stored - n);
+	if(pread(fds[deviceOf(at)], &offsets[0], size, offsetOf(at)) != (ssize_t)size) THROW_PE("pread");
+	c->blocks.insert(c->blocks.end(), offsets.begin(), offsets.end());
+    }
+
+    //Record where block n of a compressed file is stored. A full map moves to
+    //an extent twice the size, the old one is left to readers of other
+    //mounts for retireGrace seconds
+    void FS::recordBlock(File * file, uint64_t n, uint64_t offset) {
+	Compressed * c = file->compressed;
+	uint64_t room = c->map.second - c->map.first;
+	if((n+1)*sizeof(uint64_t) > room) {
+	    uint64_t size = std::max(mapSize, 2*room);
+	    uint64_t start = reserve(size);
+	    if(n > 0)
+		copyRange(fds[deviceOf(c->map.first)], offsetOf(c->map.first), fds[deviceOf(start)], offsetOf(start), n*sizeof(uint64_t));
+	    if(room > 0) {
+		retired.insert(std::make_pair(seconds() + retireGrace, c->map));
+		startMaintenance();
+	    }
+	    c->map = std::make_pair(start, start+size);
+	}
+	uint64_t at = c->map.first + n*sizeof(uint64_t);
+	if(pwrite(fds[deviceOf(at)], &offset, sizeof(offset), offsetOf(at)) != sizeof(offset)) THROW_PE("pwrite");
+    }
+
+    //Take size bytes from the end of the free space, for metadata that should
+    //stay clear of where data streams go
+    uint64_t FS::reserve(uint64_t size) {
+	for(bool grown=false; ; grown=true) {
+	    for(freespace_t::reverse_iterator i=freespace.rbegin(); i != freespace.rend(); ++i) {
+		if(i->second - i->first < size) continue;
+		uint64_t start = i->second - size;
+		freespace_t::iterator j = i.base();
+		claim(--j, start, size);
+		return start;
+	    }
+	    if(grown || !grow(size)) THROW_ERRNOG(ENOSPC, "No space left on device");
+	}
+    }
+
     void FS::create(const std::string & path, uint64_t maxfiles, uint64_t maxchunks) {
-	fdw fd = ::open(path.c_str(),O_NOATIME | O_RDWR);
-	if(fd == -1) THROW_ERRNO("Unable to open file '%s'",path.c_str());
-	off_t size = lseek(fd,0,SEEK_END);
-	if(size == -1) THROW_ERRNO("lseek failed");
+	create(std::vector<std::string>(1, path), maxfiles, maxchunks);
+    }
+
+    void FS::create(const std::vector<std::string> & paths, uint64_t maxfiles, uint64_t maxchunks) {
+	if(paths.empty()) THROW_ERRNOG(EINVAL,"No devices given");
+	if(paths.size() > (1ull << (64 - deviceShift))) THROW_ERRNOG(EINVAL,"At most %d devices", 1 << (64 - deviceShift));
 	header_t header;
 	header.magic = magic;
-	header.version = 1;
+	header.version = version;
 	header.writing = 0;
 	header.files = 0;
 	header.maxfiles = maxfiles;
 	header.maxchunks = maxchunks;
 	header.writemounted = 0;
-	if(lseek(fd,0,SEEK_SET) == -1) THROW_ERRNO("lseek failed");
-	if(write(fd,&header,sizeof(header_t)) != sizeof(header_t)) THROW_ERRNO("write failed");
-	size_t s=sizeof(file_t) + sizeof(chunk_t)*maxchunks;
-	char buf[s];
-	memset(buf,0,s);
-	for(int i=0; i< maxfiles; ++i)
-	    if(write(fd,buf,s) != s) THROW_ERRNO("write failed");
+	header.id = ((uint64_t)time(NULL) << 32) ^ ((uint64_t)getpid() << 16) ^ (uint64_t)clock();
+	header.devices = paths.size();
+	header.generation = 0;
+	memset(header.changes, 0, sizeof(header.changes));
+	for(size_t d=0; d < paths.size(); ++d) {
+	    fdw fd = ::open(paths[d].c_str(),O_NOATIME | O_RDWR);
+	    if(fd == -1) THROW_ERRNO("Unable to open file '%s'",paths[d].c_str());
+	    header.device = d;
+	    if(lseek(fd,0,SEEK_SET) == -1) THROW_ERRNO("lseek failed");
+	    if(write(fd,&header,sizeof(header_t)) != sizeof(header_t)) THROW_ERRNO("write failed");
+	    if(d != 0) continue;
+	    size_t s=sizeof(file_t) + sizeof(chunk_t)*maxchunks;
+	    char buf[s];
+	    memset(buf,0,s);
+	    for(int i=0; i< maxfiles; ++i)
+		if(write(fd,buf,s) != s) THROW_ERRNO("write failed");
+	}
     }
 
     void FS::compressFreeSpace() {
@@ -407,7 +2289,7 @@ namespace lsfs {
 	    if(a != b) {
 		uint64_t start=a->first;
 		uint64_t end=b->second;
-		freespace.erase(a,b);
+		freespace.erase(a,i);
 		freespace.insert( std::make_pair(start,end) );
 	    }
 	    a = b = i;
@@ -415,57 +2297,80 @@ namespace lsfs {
 	}
 	//std::cout << "<<compression" << std::endl;
     }
+
+    //Release everything stored beyond size, returns how much is missing if the file is shorter
+    uint64_t FS::cut(File * file, uint64_t size) {
+	size_t c=0;
+	while(size > 0 && c < file->chunks.size()) {
+	    std::pair<uint64_t, uint64_t> & cc = file->chunks[c];
+	    uint64_t s = cc.second - cc.first;
+	    c++;
+	    if(size >= s) {size-=s; continue;}
+	    release(cc.first+size, cc.second);
+	    cc.second = cc.first+size;
+	    size = 0;
+	}
+	for(size_t i=c; i < file->chunks.size(); ++i)
+	    release(file->chunks[i].first, file->chunks[i].second);
+	file->chunks.resize(c);
+	compressFreeSpace();
+	return size;
+    }
     
     void FS::unuse(File * file) {
 	file->usage--;
-	//std::cout << "Usage " << file->name << " " << file->usage << std::endl;
+	//std::cout << "Usage " << file->name() << " " << file->usage << std::endl;
 	if(file->usage == 0) {
+	    heats.erase(file);
 	    for(size_t i=0; i != file->chunks.size(); ++i)
-		freespace.insert(file->chunks[i]);
+		release(file->chunks[i].first, file->chunks[i].second);
+	    if(file->compressed) release(file->compressed->map.first, file->compressed->map.second);
 	    delete(file);
 	    compressFreeSpace();
 	}
     }
 
-    void FS::writeHeader(int fd) {
+    void FS::writeHeader() {
 	header_t header;
 	header.magic = magic;
-	header.version = 1;
+	header.version = legacy ? 1 : version;
 	header.writing = writing?1:0;
-	header.files = files.size();
+	header.files = slots.size();
 	header.maxfiles = maxfiles;
 	header.maxchunks = maxchunks;
 	header.writemounted = readonly?0:1;
-	if(lseek(fd,0,SEEK_SET) == -1) THROW_PE("lseek");
-	if(write(fd,&header, sizeof(header_t)) == -1) THROW_PE("write"); 
+	header.id = id;
+	header.devices = fds.size();
+	header.device = 0;
+	header.generation = generation;
+	std::copy(changes.begin(), changes.end(), header.changes);
+	if(pwrite(fds[0],&header, legacy ? sizeof(header1_t) : sizeof(header_t), 0) == -1) THROW_PE("pwrite"); 
+	dirty = true;
     }
 
     void FS::unlink(const std::string & name) {
 	if(readonly) THROW_ERRNOG(EROFS, "Readonly file or fs");
 	lock l(&mutex);
-	files_t::iterator i = files.find(name);
-	if(i == files.end()) THROW_ERRNOG(ENOENT,"File not found");
+	File * file = find(name);
+	if(file == NULL) THROW_ERRNOG(ENOENT,"File not found");
 	
-	fdw fd = getFd();
 	writing = true;
-	writeHeader(fd);
-
-	File * file = i->second;
-	files.erase(i);
-	filelist.erase(name);
-	if(file->index != files.size()) {
-	    files_t::iterator j = files.begin();
-	    for(files_t::iterator i = files.begin(); i != files.end(); ++i)
-		if(i->second->index > j->second->index) j=i;
-	    
-	    assert(j != files.end());
-	    j->second->index = file->index;
-	    writeFile(fd,j->second);
-	    file->index = (uint64_t)-1;
+	writeHeader();
+
+	remove(file);
+	//The file in the last slot moves into the hole
+	File * last = slots.back();
+	slots.pop_back();
+	if(last != file) {
+	    last->index = file->index;
+	    slots[last->index] = last;
+	    writeFile(last);
+	    file->index = (uint32_t)-1;
 	}
 	writing=false;
-	writeHeader(fd);
+	writeHeader();
 	unuse(file);
+	commit();
     }
 }
 
@@ -18,6 +18,13 @@ namespace lsfs {
 
 	class FS;
 
+	//A piece of a file as it is laid out on a device, see FS::deviceFd
+	struct Extent {
+		uint64_t device;
+		uint64_t offset;
+		uint64_t length;
+	};
+
 	class InternalError: public std::exception {
     private:
 		char buff[2048];
@@ -51,29 +58,132 @@ namespace lsfs {
 		const char * what() const throw () {return buff;}
 	};
 		
+	class File;
+
+	//The chunk lists of all files of a file system, in blocks of power of two
+	//sizes carved out of large pages, so a file does not need an allocation of its own
+	class ChunkArena {
+	private:
+		std::vector<std::pair<uint64_t,uint64_t> *> pages;
+		std::vector<std::vector<uint64_t> > free;  //Free blocks by size class
+		uint64_t used;                             //Carved so far
+		int pageShift;
+		void spill(uint64_t from, uint64_t to);
+		ChunkArena(const ChunkArena &);
+		ChunkArena & operator=(const ChunkArena &);
+	public:
+		ChunkArena();
+		~ChunkArena();
+		//Drop everything, blocks will hold up to largest chunks
+		void reset(uint64_t largest);
+		uint64_t allocate(int size);
+		void release(uint64_t block, int size);
+		inline std::pair<uint64_t,uint64_t> & at(uint64_t i) {
+			return pages[i >> pageShift][i & ((1ull << pageShift) - 1)];
+		}
+	};
+
+	//The chunk list of a file, a vector like view of a block in a ChunkArena
+	class Chunks {
+	private:
+		ChunkArena * arena;
+		uint32_t block;
+		uint32_t count;
+		Chunks(const Chunks &);
+		Chunks & operator=(const Chunks &);
+	public:
+		inline Chunks(ChunkArena * a): arena(a), block(0), count(0) {}
+		inline ~Chunks() {resize(0);}
+		inline size_t size() const {return count;}
+		inline bool empty() const {return count == 0;}
+		inline std::pair<uint64_t,uint64_t> & operator[](size_t i) {return arena->at(block + i);}
+		inline std::pair<uint64_t,uint64_t> & back() {return arena->at(block + count - 1);}
+		void push_back(const std::pair<uint64_t,uint64_t> & chunk);
+		void resize(size_t size);
+		void assign(const std::vector<std::pair<uint64_t,uint64_t> > & chunks);
+		bool operator==(const std::vector<std::pair<uint64_t,uint64_t> > & chunks);
+	};
+
+	//A directory of file names, it exists while something is stored below it.
+	//Every component is stored once, as the key in its parent
+	class Dir {
+	public:
+		struct less {
+			inline bool operator()(const char * a, const char * b) const {return strcmp(a, b) < 0;}
+		};
+		Dir * parent;
+		const std::string * name;             //NULL for the top
+		std::map<std::string, Dir *> dirs;
+		std::map<const char *, File *, less> files;  //Keyed by File::leaf
+		uint64_t hint;                        //Where files of the directory were last allocated
+		inline Dir(Dir * p, const std::string * n): parent(p), name(n), hint((uint64_t)-1) {}
+		~Dir();
+	};
+
+	//What only compressed files need
+	struct Compressed {
+		uint64_t length;               //Logical size
+		std::vector<uint64_t> blocks;  //Offset of every stored block
+		std::vector<uint8_t> tail;     //The last block, while it is being appended to
+		uint64_t reset;                //Generation of the last create or shrink
+		uint64_t stored;               //Blocks stored, blocks holds the offsets of those loaded
+		std::pair<uint64_t,uint64_t> map;  //Extent holding the offset of every stored block
+	};
+
     class File {
+	private:
+		File(ChunkArena * arena);
     public:
-
-		std::string name;
-		uint64_t usage;
-		std::vector<std::pair<uint64_t,uint64_t> > chunks;
-		uint64_t index;
+		Dir * dir;                     //NULL once unlinked
+		uint32_t index;                //Slot in the file table
+		uint32_t usage;
+		uint32_t flags;
+		uint32_t layout;               //Bumped when a refresh replaces the chunks
+		int error;                     //Of a close that could not store the tail
+		Chunks chunks;
+		Compressed * compressed;       //NULL for plain files
+		char leaf[1];                  //Last component of the name, allocated to fit
+		static File * create(ChunkArena * arena, const std::string & name);
+		static void operator delete(void * p);
+		~File();
+		std::string name();
 		uint64_t size();
+		uint64_t allocated();
 		friend class FS;
 	};
 	
     class Handle {
     private:
 		File * file;
-		int fd;
 		friend class FS;
 		FS * fs;
 		uint64_t cl;
 		uint64_t chunk;
 		bool readOnly;
+		uint64_t pos;      //Logical position in the file
+		uint64_t rapos;    //Logical position where the last read ended
+		uint64_t raend;    //Readahead has been issued up to here, in stored bytes for compressed files
+		uint64_t rawindow; //Current readahead window, grows while reads are sequential
+		std::vector<uint8_t> cache; //Decompressed block of a compressed file
+		uint64_t cacheBlock;
+		uint32_t layout;   //File::layout the position was computed against
 		void allocate(uint64_t size);
-		void seekset();
+		uint64_t map(uint64_t size, std::vector<std::pair<uint64_t,uint64_t> > & extents, bool extend);
+		void locate(uint64_t where);
+		void mapAt(uint64_t offset, uint64_t size, std::vector<std::pair<uint64_t,uint64_t> > & extents);
+		void revalidate();
+		void readahead(uint64_t size);
+		void loadBlock(uint64_t block);
+		uint64_t fromCache(uint8_t * buf, uint64_t size);
+		void readaheadStored(uint64_t end);
+		void loadTail();
+		void flushTail();
+		void closeError();
+		uint64_t readCompressed(uint8_t * buf, uint64_t size);
+		void writeCompressed(const uint8_t * buf, uint64_t size);
+		void truncateCompressed(uint64_t size);
     public:
+		//Let go of the file, call flush first to see errors storing or flushing what is buffered
 		void close();
 		Handle();
 		Handle(const Handle & h);
@@ -81,48 +191,168 @@ namespace lsfs {
 		void seek(uint64_t where);
 		uint64_t read(uint8_t * buf, uint64_t size);
 		void write(const uint8_t * buf, uint64_t size); 
+		//Copy size bytes at offset in fd to the current position, without passing through user space
+		void copyFrom(int fd, uint64_t offset, uint64_t size);
+		//Copy up to size bytes from the current position to offset in fd, returns the number copied
+		uint64_t copyTo(int fd, uint64_t offset, uint64_t size);
+		//The device extents holding up to size bytes from offset, not available for compressed files
+		std::vector<Extent> extents(uint64_t offset, uint64_t size);
+		//Send up to size bytes from offset to fd (typically a socket) with sendfile, returns the number sent
+		uint64_t sendTo(int fd, uint64_t offset, uint64_t size);
+		//Write out the tail a compressed file buffers, durable only in strict mode
+		void flush();
+		//Make everything written so far durable, concurrent calls share one device flush
+		void sync();
 		uint64_t size();
 		uint64_t tell();
 		void truncate(uint64_t size);
     };
 
-	typedef std::map<std::string, File *> files_t;
-	typedef std::set<std::string> filelist_t;
 	typedef std::set<std::pair<uint64_t,uint64_t> > freespace_t;
     class FS {
+    public:
+		enum Durability {
+			syncNone,      //Leave it to the kernel
+			syncPeriodic,  //Flush the devices every few seconds when something was written
+			syncStrict     //Flush the devices before a change returns
+		};
     private:
 		pthread_mutex_t mutex;
 		
 		friend class Handle;
-		files_t files;
-		filelist_t filelist;
+		Dir * root;
+		ChunkArena arena;
 		freespace_t freespace;
-		std::string path;
+		std::vector<std::string> paths;
+		std::vector<int> fds;  //Indexed by device
+		uint64_t id;
+		uint64_t stripe;       //Device to start the next striped allocation on
+		std::map<File *, uint64_t> writers;    //Open writable handles per file
+		std::vector<uint64_t> sizes;           //Indexed by device
+		std::vector<bool> growable;            //Devices that are regular files
+		uint64_t growStep;
+		uint64_t growLimit;
+
+		pthread_t thread;       //Background maintenance, started on demand
+		pthread_cond_t cond;
+		bool running;
+		bool stopping;
+		bool discard;
+		freespace_t discards;   //Released space not yet punched out of the devices
+		uint64_t discarded;
+
+		struct heat_t {
+			double reads;       //Bytes, decaying with time
+			double writes;
+			uint64_t stamp;     //When last decayed
+			uint64_t modified;  //Counts writes, so a move can tell it raced one
+		};
+		std::map<File *, heat_t> heats;  //Files used lately
+		uint64_t hotDevice;
+		uint64_t hotSize;       //Of the region hot files are packed into, 0 when off
+		uint64_t cooled;        //When the heats were last decayed all together
+
+		Durability durability;
+		bool dirty;             //Written to since the last device flush started
+		bool syncing;           //A device flush is running
+		uint64_t syncRequested; //Tickets handed to callers of sync
+		uint64_t syncDone;      //Covered by a finished device flush
+		pthread_cond_t synced;
+		int failure;            //Errno of the first error nobody could be told about
+		std::string failureWhat;
+
+		std::multiset<std::pair<uint64_t,uint64_t> > pinned;  //Extents used by transfers without the lock
+		freespace_t held;       //Released while pinned
+		std::multimap<uint64_t, std::pair<uint64_t,uint64_t> > retired;  //Moved away from, by when it may be released
+
 		uint64_t _size;
-		
-		//int inotifyfd;
+
+		int inotifyfd;          //Watches the file table of a read only mount
+		bool stale;             //The file table changed since the last refresh
+		uint64_t generation;    //Of the file table, bumped for every slot written
+		std::vector<uint64_t> changes;  //Slot written at each generation, a ring
+		std::vector<File *> slots;      //The file in each slot of the table
 		bool readonly;
 		uint64_t maxfiles;
 		uint64_t maxchunks;
 		bool writing;
 
 		size_t filesize;
+		bool legacy;            //A version 1 table, kept in its layout
+		uint64_t tableStart;    //Of the file table on device 0
 
 		void unuse(File * file);
-		void writeHeader(int fd);
-		void writeFile(int fd, File * file);
-		int getFd();
+		void writeHeader();
+		void writeFile(File * file);
+		void refresh();
+		Dir * walk(const std::string & path, bool create);
+		File * find(const std::string & name);
+		void insert(File * file, const std::string & name);
+		void remove(File * file);
+		static void collect(Dir * dir, std::vector<std::string> & names);
+		uint64_t cut(File * file, uint64_t size);
+		freespace_t::iterator place(File * file, uint64_t device, uint64_t size, uint64_t & start, bool whole=false);
+		uint64_t claim(freespace_t::iterator i, uint64_t start, uint64_t size);
+		uint64_t take(File * file, freespace_t::iterator i, uint64_t start, uint64_t size);
+		uint64_t extend(File * file, uint64_t size);
+		void unwrite(File * file);
+		void release(uint64_t start, uint64_t end);
+		void reclaim(uint64_t start, uint64_t end);
+		void pin(const std::vector<std::pair<uint64_t,uint64_t> > & extents);
+		void unpin(const std::vector<std::pair<uint64_t,uint64_t> > & extents);
+		void punch();
+		bool grow(uint64_t size);
+		void startMaintenance();
+		static void * maintenance(void * fs);
+		void storedIO(File * file, uint64_t offset, uint8_t * buf, uint64_t size, bool write);
+		void loadBlocks(File * file);
+		uint64_t blockEnd(File * file, uint64_t b);
+		void recordBlock(File * file, uint64_t n, uint64_t offset);
+		uint64_t reserve(uint64_t size);
+		void storedExtents(File * file, uint64_t offset, uint64_t size, std::vector<std::pair<uint64_t,uint64_t> > & extents);
 		void compressFreeSpace();
+		void touch(File * file, uint64_t size, bool write);
+		static void decay(heat_t & h, uint64_t now);
+		void cool(uint64_t now);
+		void hotRegion(uint64_t & start, uint64_t & end);
+		void scanRegion(std::vector<uint32_t> & inside);
+		File * pickMove(uint64_t & start, std::vector<uint32_t> & inside, bool & crowded);
+		void relocate();
+		void groupSync();
+		void commit();
+		void fail(const std::exception & e);
     public:
 		FS();
 		~FS();
 		static void create(const std::string & path, uint64_t maxfiles=1000, uint64_t maxchunks=128);
+		static void create(const std::vector<std::string> & paths, uint64_t maxfiles=1000, uint64_t maxchunks=128);
 		void mount(const std::string & path, bool readOnly, bool ignorewm=false);
+		void mount(const std::vector<std::string> & paths, bool readOnly, bool ignorewm=false);
 		void umount();
-		inline const std::set<std::string> & ls() {return filelist;}
-		Handle * open(const std::string & name, bool readOnly=true, Handle * f=NULL);
+		//Punch holes in the devices for freed space (on by default)
+		void setDiscard(bool discard);
+		//Grow regular file devices in steps of step bytes, up to limit bytes (0 for no limit), when full
+		void setGrowth(uint64_t step, uint64_t limit=0);
+		//Pack the most read files into the first size bytes of a device in the background, 0 to stop
+		void setHotRegion(uint64_t device, uint64_t size);
+		//Bytes read from and written to a file lately, decaying by half every few minutes
+		void heat(const std::string & name, double & reads, double & writes);
+		void setDurability(Durability durability);
+		//Make everything written so far durable
+		void sync();
+		//The errno of the first error background work could not throw, 0 if none, and clear it
+		int lastError(std::string & what);
+		//Whether name is a file or a directory (something is stored below it), false if neither
+		bool lookup(const std::string & name, bool & directory, uint64_t & size);
+		//The names directly below a directory, "" for the top
+		std::vector<std::string> list(const std::string & directory);
+		//The full names of a file and of everything below it, everything for ""
+		std::vector<std::string> names(const std::string & path);
+		Handle * open(const std::string & name, bool readOnly=true, Handle * f=NULL, bool compress=false);
 		void unlink(const std::string & name);
 		uint64_t size(const std::string & name);
+		//The descriptor of a device, valid until umount
+		int deviceFd(uint64_t device);
 		static void defrag(const std::string & path);
     };
 }
@@ -0,0 +1,120 @@
+//-*- mode: c++; tab-width: 4; indent-tabs-mode: t; c-file-style: "stroustrup";
+#include "lz.hh"
+#include <cstring>
+
+namespace {
+    const size_t minMatch = 4;
+    const size_t lastLiterals = 5;
+    const size_t matchLimit = 12;
+    const size_t maxOffset = 0xFFFF;
+    const int hashBits = 12;
+
+    inline uint32_t read32(const uint8_t * p) {
+	uint32_t x;
+	memcpy(&x, p, sizeof(x));
+	return x;
+    }
+
+    inline uint32_t hash(uint32_t x) {
+	return (x * 2654435761u) >> (32 - hashBits);
+    }
+
+    //Write a length continuation as a run of 255 bytes and a remainder
+    inline bool putLength(uint8_t * dst, size_t cap, size_t & op, size_t len) {
+	for(; len >= 255; len -= 255) {
+	    if(op == cap) return false;
+	    dst[op++] = 255;
+	}
+	if(op == cap) return false;
+	dst[op++] = len;
+	return true;
+    }
+
+    inline bool getLength(const uint8_t * src, size_t size, size_t & ip, size_t & len) {
+	uint8_t b;
+	do {
+	    if(ip == size) return false;
+	    b = src[ip++];
+	    len += b;
+	} while(b == 255);
+	return true;
+    }
+
+    //Emit a sequence of literals followed by a match, a match length of 0 means literals only
+    bool emit(uint8_t * dst, size_t cap, size_t & op, const uint8_t * lit, size_t litlen, size_t offset, size_t mlen) {
+	if(op == cap) return false;
+	size_t t = op++;
+	uint8_t token = (litlen < 15 ? litlen : 15) << 4;
+	if(litlen >= 15 && !putLength(dst, cap, op, litlen - 15)) return false;
+	if(cap - op < litlen) return false;
+	memcpy(dst+op, lit, litlen);
+	op += litlen;
+	if(mlen != 0) {
+	    mlen -= minMatch;
+	    token |= mlen < 15 ? mlen : 15;
+	    if(cap - op < 2) return false;
+	    dst[op++] = offset & 0xFF;
+	    dst[op++] = offset >> 8;
+	    if(mlen >= 15 && !putLength(dst, cap, op, mlen - 15)) return false;
+	}
+	dst[t] = token;
+	return true;
+    }
+}
+
+namespace lsfs {
+    namespace lz {
+	size_t compress(const uint8_t * src, size_t size, uint8_t * dst, size_t cap) {
+	    uint32_t table[1 << hashBits];
+	    memset(table, 0, sizeof(table));
+	    size_t ip=0, anchor=0, op=0;
+	    if(size > matchLimit) {
+		size_t limit = size - matchLimit;
+		size_t mlimit = size - lastLiterals;
+		while(ip < limit) {
+		    uint32_t seq = read32(src+ip);
+		    uint32_t h = hash(seq);
+		    size_t ref = table[h];
+		    table[h] = ip;
+		    if(ref >= ip || ip - ref > maxOffset || read32(src+ref) != seq) {
+			//Skip faster through data that does not compress
+			ip += 1 + ((ip - anchor) >> 6);
+			continue;
+		    }
+		    size_t len = minMatch;
+		    while(ip + len < mlimit && src[ref+len] == src[ip+len]) ++len;
+		    if(!emit(dst, cap, op, src+anchor, ip-anchor, ip-ref, len)) return 0;
+		    ip += len;
+		    anchor = ip;
+		}
+	    }
+	    if(!emit(dst, cap, op, src+anchor, size-anchor, 0, 0)) return 0;
+	    return op;
+	}
+
+	size_t decompress(const uint8_t * src, size_t size, uint8_t * dst, size_t cap) {
+	    size_t ip=0, op=0;
+	    while(ip < size) {
+		uint8_t token = src[ip++];
+		size_t litlen = token >> 4;
+		if(litlen == 15 && !getLength(src, size, ip, litlen)) return (size_t)-1;
+		if(size - ip < litlen || cap - op < litlen) return (size_t)-1;
+		memcpy(dst+op, src+ip, litlen);
+		ip += litlen;
+		op += litlen;
+		if(ip == size) break; //The last sequence has no match
+		if(size - ip < 2) return (size_t)-1;
+		size_t offset = src[ip] | (src[ip+1] << 8);
+		ip += 2;
+		if(offset == 0 || offset > op) return (size_t)-1;
+		size_t mlen = token & 15;
+		if(mlen == 15 && !getLength(src, size, ip, mlen)) return (size_t)-1;
+		mlen += minMatch;
+		if(cap - op < mlen) return (size_t)-1;
+		//Matches may overlap the output, so copy byte by byte
+		for(size_t i=0; i < mlen; ++i, ++op) dst[op] = dst[op - offset];
+	    }
+	    return op;
+	}
+    }
+}
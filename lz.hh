@@ -0,0 +1,18 @@
+//-*- mode: c++; tab-width: 4; indent-tabs-mode: t; c-file-style: "stroustrup"; -*-
+#ifndef __LSFS_LZ_HH__
+#define __LSFS_LZ_HH__
+
+#include <cstddef>
+#include <stdint.h>
+
+namespace lsfs {
+	//A small LZ77 codec using the LZ4 block layout, used for compressed files
+	namespace lz {
+		//Returns the compressed size, or 0 if the result does not fit in cap bytes
+		size_t compress(const uint8_t * src, size_t size, uint8_t * dst, size_t cap);
+		//Returns the decompressed size, or (size_t)-1 if the input is corrupt
+		size_t decompress(const uint8_t * src, size_t size, uint8_t * dst, size_t cap);
+	}
+}
+
+#endif //__LSFS_LZ_HH__
@@ -5,17 +5,17 @@
 
 int main(int argc, char ** argv) {
     namespace po = boost::program_options;
-    po::options_description desc("Usage: mkfs.lsfs [OPTIONS]... [DEVICE]\n\nMake a lsfs file system");
+    po::options_description desc("Usage: mkfs.lsfs [OPTIONS]... [DEVICE]...\n\nMake a lsfs file system, striped over all the given devices");
     uint64_t maxfiles=1024;
     uint64_t maxchunks=128;
-    std::string dev;
+    std::vector<std::string> devs;
     desc.add_options()
 	("help,h","This help message.")
 	("maxfiles,f",po::value<uint64_t>(&maxfiles),"Maximum number of files the filesystem will support")
 	("maxchunks,c",po::value<uint64_t>(&maxchunks),"Maxinum number of chunks a file can be split into")
-	("device,d",po::value<std::string>(&dev),"The device file to format");
+	("device,d",po::value<std::vector<std::string> >(&devs),"The device files to format");
     po::positional_options_description pd; 
-    pd.add("device", 1);
+    pd.add("device", -1);
     
     try {
 	po::variables_map vm;
@@ -27,9 +27,9 @@ int main(int argc, char ** argv) {
 	    std::cout << desc << std::endl;
 	    return 0;
 	} 
-	if(dev == "") throw po::error("you must specify a device file");
+	if(devs.empty()) throw po::error("you must specify a device file");
 	std::cout << "Creating filesystem" << std::endl;
-	lsfs::FS::create(dev, maxfiles, maxchunks);
+	lsfs::FS::create(devs, maxfiles, maxchunks);
 	std::cout << "   Done!" << std::endl;
     } catch(po::error & e) {
 	std::cerr << e.what() << std::endl;